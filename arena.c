@@ -0,0 +1,113 @@
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 64
+#define ARENA_MIN_CHUNK (1 << 20)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size, used;
+	char *mem;
+};
+
+struct arena {
+	struct arena_chunk *chunk; /* the one being allocated from is first */
+	size_t total;
+};
+
+static struct arena_chunk *new_chunk(size_t size)
+{
+	struct arena_chunk *c = malloc(sizeof(*c));
+	void *mem;
+
+	if (!c || posix_memalign(&mem, ARENA_ALIGN, size)) {
+		fprintf(stderr, "pseudo_erosion: out of memory allocating %zu byte arena\n", size);
+		exit(1);
+	}
+	c->next = NULL;
+	c->size = size;
+	c->used = 0;
+	c->mem = mem;
+	return c;
+}
+
+struct arena *arena_create(void)
+{
+	struct arena *a = malloc(sizeof(*a));
+
+	a->chunk = NULL;
+	a->total = 0;
+	return a;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_chunk *c = a->chunk;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	if (!c || c->size - c->used < size) {
+		c = new_chunk(size > ARENA_MIN_CHUNK ? size : ARENA_MIN_CHUNK);
+		c->next = a->chunk;
+		a->chunk = c;
+		a->total += c->size;
+	}
+	p = c->mem + c->used;
+	c->used += size;
+	return p;
+}
+
+static void free_chunks(struct arena_chunk *c)
+{
+	struct arena_chunk *next;
+
+	for (; c; c = next) {
+		next = c->next;
+		free(c->mem);
+		free(c);
+	}
+}
+
+void arena_reset(struct arena *a)
+{
+	if (a->chunk && a->chunk->next) {
+		free_chunks(a->chunk);
+		a->chunk = new_chunk(a->total);
+	}
+	if (a->chunk)
+		a->chunk->used = 0;
+}
+
+void arena_destroy(struct arena *a)
+{
+	free_chunks(a->chunk);
+	free(a);
+}
+
+size_t arena_size(struct arena *a)
+{
+	return a->total;
+}
@@ -0,0 +1,44 @@
+#ifndef ARENA_H__
+#define ARENA_H__
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * A bump allocator for big, short lived buffers.  arena_alloc() hands out
+ * 64 byte aligned blocks (neither zeroed nor individually freeable) from
+ * the arena's current chunk, adding chunks as needed.  arena_reset() gives
+ * everything back at once and keeps the memory: if it had to grow since the
+ * last reset, the chunks are merged into one big enough for all of them,
+ * so a program running the same job over and over settles into a single
+ * allocation that is never returned to malloc.
+ */
+
+#include <stddef.h>
+
+struct arena;
+
+struct arena *arena_create(void);
+void *arena_alloc(struct arena *a, size_t size);
+void arena_reset(struct arena *a);
+void arena_destroy(struct arena *a);
+size_t arena_size(struct arena *a); /* total bytes held */
+
+#endif
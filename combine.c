@@ -0,0 +1,434 @@
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Like erosion_kernel.c, this file must be compiled with -ffp-contract=off
+ * so that no variant fuses multiplies and adds the others don't, and with
+ * -fno-math-errno so that sqrt() can be vectorized.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "combine.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_VARIANTS 1
+#endif
+
+typedef pseudo_erosion_height height_t;
+
+struct expr_parser {
+	const char *s;
+	struct combine_program *prog;
+	int iteration;
+	char error[80]; /* empty if all is well */
+};
+
+static void parse_sum(struct expr_parser *ps);
+
+static void emit(struct expr_parser *ps, enum combine_opcode op, int layer, double value)
+{
+	struct combine_op *o;
+
+	if (ps->prog->nops == COMBINE_MAX_OPS) {
+		if (!ps->error[0])
+			snprintf(ps->error, sizeof(ps->error), "expression is too long");
+		return;
+	}
+	o = &ps->prog->op[ps->prog->nops++];
+	o->op = op;
+	o->layer = layer;
+	o->value = value;
+}
+
+static void skip_space(struct expr_parser *ps)
+{
+	while (isspace((unsigned char) *ps->s))
+		ps->s++;
+}
+
+/* Skip over word if that's what comes next */
+static int word(struct expr_parser *ps, const char *word)
+{
+	int n = strlen(word);
+
+	if (strncmp(ps->s, word, n) != 0 || isalnum((unsigned char) ps->s[n]) || ps->s[n] == '_')
+		return 0;
+	ps->s += n;
+	return 1;
+}
+
+static void expect(struct expr_parser *ps, char c)
+{
+	skip_space(ps);
+	if (*ps->s == c) {
+		ps->s++;
+	} else if (!ps->error[0]) {
+		snprintf(ps->error, sizeof(ps->error), "expected '%c' at '%.20s'", c, ps->s);
+	}
+}
+
+static void parse_primary(struct expr_parser *ps)
+{
+	char *end;
+	int j;
+
+	skip_space(ps);
+	if (ps->error[0])
+		return;
+	if (*ps->s == '(') {
+		ps->s++;
+		parse_sum(ps);
+		expect(ps, ')');
+	} else if (word(ps, "sqr") || word(ps, "sqrt")) {
+		enum combine_opcode op = ps->s[-1] == 't' ? COMBINE_SQRT : COMBINE_SQR;
+
+		expect(ps, '(');
+		parse_sum(ps);
+		expect(ps, ')');
+		emit(ps, op, 0, 0.0);
+	} else if (word(ps, "a")) {
+		emit(ps, COMBINE_IMAGE, 0, 0.0);
+	} else if (word(ps, "h")) {
+		emit(ps, COMBINE_HEIGHT, 0, 0.0);
+		ps->prog->uses_height = 1;
+	} else if (ps->s[0] == 'l' && isdigit((unsigned char) ps->s[1]) && !isalnum((unsigned char) ps->s[2])) {
+		j = ps->s[1] - '0';
+		if (j >= ps->iteration) {
+			snprintf(ps->error, sizeof(ps->error), "l%d is not an earlier iteration's layer", j);
+			return;
+		}
+		ps->s += 2;
+		emit(ps, COMBINE_LAYER, j, 0.0);
+		ps->prog->layers |= 1U << j;
+	} else if (isdigit((unsigned char) *ps->s) || *ps->s == '.') {
+		emit(ps, COMBINE_CONST, 0, strtod(ps->s, &end));
+		ps->s = end;
+	} else {
+		snprintf(ps->error, sizeof(ps->error), "unexpected '%.20s'", *ps->s ? ps->s : "end");
+	}
+}
+
+static void parse_unary(struct expr_parser *ps)
+{
+	skip_space(ps);
+	if (*ps->s == '-') {
+		ps->s++;
+		parse_unary(ps);
+		emit(ps, COMBINE_NEG, 0, 0.0);
+	} else {
+		parse_primary(ps);
+	}
+}
+
+static void parse_product(struct expr_parser *ps)
+{
+	char c;
+
+	parse_unary(ps);
+	for (skip_space(ps); !ps->error[0] && (*ps->s == '*' || *ps->s == '/'); skip_space(ps)) {
+		c = *ps->s++;
+		parse_unary(ps);
+		emit(ps, c == '*' ? COMBINE_MUL : COMBINE_DIV, 0, 0.0);
+	}
+}
+
+static void parse_sum(struct expr_parser *ps)
+{
+	char c;
+
+	parse_product(ps);
+	for (skip_space(ps); !ps->error[0] && (*ps->s == '+' || *ps->s == '-'); skip_space(ps)) {
+		c = *ps->s++;
+		parse_product(ps);
+		emit(ps, c == '+' ? COMBINE_ADD : COMBINE_SUB, 0, 0.0);
+	}
+}
+
+/* How deep the program's stack gets */
+static int stack_depth(const struct combine_program *prog)
+{
+	int i, n = 0, max = 0;
+
+	for (i = 0; i < prog->nops; i++) {
+		switch (prog->op[i].op) {
+		case COMBINE_CONST:
+		case COMBINE_IMAGE:
+		case COMBINE_HEIGHT:
+		case COMBINE_LAYER:
+			n++;
+			break;
+		case COMBINE_ADD:
+		case COMBINE_SUB:
+		case COMBINE_MUL:
+		case COMBINE_DIV:
+			n--;
+			break;
+		default:
+			break;
+		}
+		if (n > max)
+			max = n;
+	}
+	return max;
+}
+
+static int parse(const char *text, int iteration, struct combine_program *prog, char *whynot, int whynotlen)
+{
+	struct expr_parser ps;
+
+	memset(prog, 0, sizeof(*prog));
+	ps.s = text;
+	ps.prog = prog;
+	ps.iteration = iteration;
+	ps.error[0] = '\0';
+	parse_sum(&ps);
+	skip_space(&ps);
+	if (!ps.error[0] && *ps.s)
+		snprintf(ps.error, sizeof(ps.error), "unexpected '%.20s'", ps.s);
+	if (!ps.error[0] && stack_depth(prog) > COMBINE_MAX_DEPTH)
+		snprintf(ps.error, sizeof(ps.error), "expression is nested too deeply");
+	if (ps.error[0]) {
+		snprintf(whynot, whynotlen, "%s", ps.error);
+		return PSEUDO_EROSION_BAD_PARAMS;
+	}
+	return 0;
+}
+
+static int same_program(const struct combine_program *a, const struct combine_program *b)
+{
+	int i;
+
+	if (a->nops != b->nops)
+		return 0;
+	for (i = 0; i < a->nops; i++)
+		if (a->op[i].op != b->op[i].op || a->op[i].layer != b->op[i].layer ||
+			a->op[i].value != b->op[i].value)
+			return 0;
+	return 1;
+}
+
+int combine_is_just_the_image(const struct combine_program *prog)
+{
+	return prog->nops == 1 && prog->op[0].op == COMBINE_IMAGE;
+}
+
+/*
+ * The interpreter.  The stack holds a block of values per entry, and each
+ * op is a loop over the block.
+ */
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+ALWAYS_INLINE void load_block(double *r, const height_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		r[i] = src[i];
+}
+
+ALWAYS_INLINE void interpret(const struct combine_program *prog, const struct combine_args *c, int n)
+{
+	double stack[COMBINE_MAX_DEPTH][COMBINE_BLOCK];
+	double *x, *y;
+	height_t *acc = c->acc;
+	int base, m, i, k, sp;
+
+	for (base = 0; base < n; base += COMBINE_BLOCK) {
+		m = n - base < COMBINE_BLOCK ? n - base : COMBINE_BLOCK;
+		sp = 0;
+		for (k = 0; k < prog->nops; k++) {
+			switch (prog->op[k].op) {
+			case COMBINE_CONST:
+				x = stack[sp++];
+				for (i = 0; i < m; i++)
+					x[i] = prog->op[k].value;
+				break;
+			case COMBINE_IMAGE:
+				load_block(stack[sp++], &c->prev[base], m);
+				break;
+			case COMBINE_HEIGHT:
+				load_block(stack[sp++], &c->h[base], m);
+				break;
+			case COMBINE_LAYER:
+				load_block(stack[sp++], &c->layer[prog->op[k].layer][base], m);
+				break;
+			case COMBINE_ADD:
+				x = stack[--sp];
+				y = stack[sp - 1];
+				for (i = 0; i < m; i++)
+					y[i] = y[i] + x[i];
+				break;
+			case COMBINE_SUB:
+				x = stack[--sp];
+				y = stack[sp - 1];
+				for (i = 0; i < m; i++)
+					y[i] = y[i] - x[i];
+				break;
+			case COMBINE_MUL:
+				x = stack[--sp];
+				y = stack[sp - 1];
+				for (i = 0; i < m; i++)
+					y[i] = y[i] * x[i];
+				break;
+			case COMBINE_DIV:
+				x = stack[--sp];
+				y = stack[sp - 1];
+				for (i = 0; i < m; i++)
+					y[i] = y[i] / x[i];
+				break;
+			case COMBINE_NEG:
+				x = stack[sp - 1];
+				for (i = 0; i < m; i++)
+					x[i] = -x[i];
+				break;
+			case COMBINE_SQR:
+				x = stack[sp - 1];
+				for (i = 0; i < m; i++)
+					x[i] = x[i] * x[i];
+				break;
+			case COMBINE_SQRT:
+				x = stack[sp - 1];
+				for (i = 0; i < m; i++)
+					x[i] = sqrt(x[i]);
+				break;
+			}
+		}
+		for (i = 0; i < m; i++)
+			acc[base + i] = stack[0][i];
+	}
+}
+
+/* The built in pipeline's formulas, exactly as the program for each would
+ * evaluate them
+ */
+ALWAYS_INLINE void formula1(const struct combine_args *c, int n)
+{
+	height_t *acc = c->acc;
+	const height_t *a = c->prev, *h = c->h;
+	int i;
+
+	for (i = 0; i < n; i++)
+		acc[i] = 0.25 * (double) h[i] + 0.5 * (double) a[i];
+}
+
+ALWAYS_INLINE void formula2(const struct combine_args *c, int n)
+{
+	height_t *acc = c->acc;
+	const height_t *a = c->prev, *h = c->h;
+	int i;
+
+	for (i = 0; i < n; i++)
+		acc[i] = (double) a[i] + (double) h[i] * (double) h[i];
+}
+
+ALWAYS_INLINE void formula3(const struct combine_args *c, int n)
+{
+	height_t *acc = c->acc;
+	const height_t *a = c->prev, *h = c->h, *l2 = c->layer[2];
+	int i;
+
+	for (i = 0; i < n; i++)
+		acc[i] = (double) a[i] + (double) l2[i] * 0.5 * (double) h[i];
+}
+
+ALWAYS_INLINE void formula4(const struct combine_args *c, int n)
+{
+	height_t *acc = c->acc;
+	const height_t *a = c->prev, *h = c->h, *l2 = c->layer[2], *l3 = c->layer[3];
+	int i;
+
+	for (i = 0; i < n; i++)
+		acc[i] = (double) a[i] + sqrt((double) l2[i] * (double) l3[i]) * 0.3333 * (double) h[i];
+}
+
+/* Each of the above, built for one instruction set */
+#define COMBINE_VARIANTS(isa, target) \
+	target static void interpret_##isa(const struct combine_program *prog, \
+					const struct combine_args *c, int n) \
+	{ \
+		interpret(prog, c, n); \
+	} \
+	target static void formula1_##isa(__attribute__((unused)) const struct combine_program *prog, \
+					const struct combine_args *c, int n) \
+	{ \
+		formula1(c, n); \
+	} \
+	target static void formula2_##isa(__attribute__((unused)) const struct combine_program *prog, \
+					const struct combine_args *c, int n) \
+	{ \
+		formula2(c, n); \
+	} \
+	target static void formula3_##isa(__attribute__((unused)) const struct combine_program *prog, \
+					const struct combine_args *c, int n) \
+	{ \
+		formula3(c, n); \
+	} \
+	target static void formula4_##isa(__attribute__((unused)) const struct combine_program *prog, \
+					const struct combine_args *c, int n) \
+	{ \
+		formula4(c, n); \
+	} \
+	static const combine_span_fn variants_##isa[] = { \
+		interpret_##isa, formula1_##isa, formula2_##isa, formula3_##isa, formula4_##isa, \
+	};
+
+COMBINE_VARIANTS(generic, )
+#ifdef HAVE_X86_VARIANTS
+COMBINE_VARIANTS(avx2, __attribute__((target("avx2"))))
+COMBINE_VARIANTS(avx512, __attribute__((target("avx512f"))))
+#endif
+
+static const combine_span_fn *widest_variants(void)
+{
+#ifdef HAVE_X86_VARIANTS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return variants_avx512;
+	if (__builtin_cpu_supports("avx2"))
+		return variants_avx2;
+#endif
+	return variants_generic;
+}
+
+int combine_compile(const char *text, int iteration, struct combine_program *prog,
+			char *whynot, int whynotlen)
+{
+	static const char *const formula[] = { COMBINE_F1, COMBINE_F2, COMBINE_F3, COMBINE_F4 };
+	struct combine_program f;
+	int i;
+
+	if (parse(text, iteration, prog, whynot, whynotlen))
+		return PSEUDO_EROSION_BAD_PARAMS;
+	for (i = 0; i < 4; i++) {
+		parse(formula[i], PSEUDO_EROSION_MAX_ITERATIONS, &f, NULL, 0);
+		if (same_program(prog, &f)) {
+			prog->formula = i + 1;
+			break;
+		}
+	}
+	prog->span = widest_variants()[prog->formula];
+	return 0;
+}
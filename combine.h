@@ -0,0 +1,109 @@
+#ifndef COMBINE_H__
+#define COMBINE_H__
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * The combine engine: an iteration's combine expression (see
+ * libpseudoerosion.h) compiled to a small stack machine program, and run
+ * over spans of pixels.  The interpreter works on blocks of
+ * COMBINE_BLOCK pixels at a time, each op being one loop over the block,
+ * so the per op dispatch is paid once per block rather than per pixel and
+ * the loops vectorize.  The built in pipeline's formulas have their own
+ * loops instead.  Everything is built for plain x86-64, AVX2 and AVX-512,
+ * and combine_compile() picks the widest the cpu can run.
+ *
+ * Every variant does the same IEEE operations in the same order as
+ * evaluating the expression one pixel at a time in double, so they all
+ * give exactly the same results.
+ */
+
+#include "libpseudoerosion.h"
+
+#define COMBINE_MAX_OPS 32
+#define COMBINE_MAX_DEPTH 16
+#define COMBINE_BLOCK 64
+
+/* The built in pipeline's formulas */
+#define COMBINE_F1 "0.25 * h + 0.5 * a"
+#define COMBINE_F2 "a + sqr(h)"
+#define COMBINE_F3 "a + l2 * 0.5 * h"
+#define COMBINE_F4 "a + sqrt(l2 * l3) * 0.3333 * h"
+
+enum combine_opcode {
+	COMBINE_CONST,
+	COMBINE_IMAGE, /* a */
+	COMBINE_HEIGHT, /* h */
+	COMBINE_LAYER, /* l0 .. l7 */
+	COMBINE_ADD,
+	COMBINE_SUB,
+	COMBINE_MUL,
+	COMBINE_DIV,
+	COMBINE_NEG,
+	COMBINE_SQR,
+	COMBINE_SQRT,
+};
+
+struct combine_op {
+	enum combine_opcode op;
+	int layer;
+	double value;
+};
+
+/* Where a span's pixels are: each pointer is to the span's first pixel.
+ * acc may be the same as prev, and pointers the program doesn't use may
+ * be NULL.
+ */
+struct combine_args {
+	pseudo_erosion_height *acc;
+	const pseudo_erosion_height *prev; /* a */
+	const pseudo_erosion_height *h;
+	const pseudo_erosion_height *layer[PSEUDO_EROSION_MAX_ITERATIONS];
+};
+
+struct combine_program;
+typedef void (*combine_span_fn)(const struct combine_program *prog, const struct combine_args *c, int n);
+
+struct combine_program {
+	int nops;
+	struct combine_op op[COMBINE_MAX_OPS];
+	unsigned int layers; /* bit j set if l<j> is used */
+	int uses_height;
+	int formula; /* 1 to 4 if it is COMBINE_F1 .. COMBINE_F4, else 0 */
+	combine_span_fn span;
+};
+
+/* Compile iteration i's expression.  0, or PSEUDO_EROSION_BAD_PARAMS with
+ * the reason in whynot.
+ */
+int combine_compile(const char *text, int iteration, struct combine_program *prog,
+			char *whynot, int whynotlen);
+
+/* If all the expression does is leave the image as it was */
+int combine_is_just_the_image(const struct combine_program *prog);
+
+/* c->acc[k] = expression for k = 0 .. n - 1 */
+static inline void combine_span(const struct combine_program *prog, const struct combine_args *c, int n)
+{
+	prog->span(prog, c, n);
+}
+
+#endif
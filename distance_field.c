@@ -0,0 +1,428 @@
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "thread_pool.h"
+#include "distance_field.h"
+
+/* Segments are rasterized into a margin this many pixels wide around the
+ * image too, and the parts of them outside that onto its edge, so that
+ * segments lying outside still get found.
+ */
+#define DF_PAD 16
+#define COLUMN_STRIP 16
+#define NO_SEGMENT (-1)
+#define NO_DISTANCE (1e300)
+
+struct df {
+	const struct distance_field_segments *s;
+	enum distance_field_engine engine;
+	int dim, pad, w; /* w = dim + 2 * pad, the padded domain */
+	double *coord; /* coord[i] = (i - pad) / feature_size */
+	/* every segment rasterized into pixel p: seed[start[p]] ... seed[start[p + 1] - 1] */
+	int32_t *start, *seed;
+	int32_t *vid; /* EDT: nearest seed pixel in the same column... */
+	double *vd2; /* ...and its squared distance */
+	int32_t *cur, *next; /* nearest segment so far, double buffered */
+	int step;
+	int *changed; /* per row, pixels a pass found a nearer segment for */
+	/* EDT: which pixels the pass found a nearer segment for, if not NULL,
+	 * and which the one before did.  Once settling, a pass only looks at
+	 * pixels next to ones the pass before changed, the rest can't change.
+	 */
+	uint8_t *moved, *was_moved;
+	int *was_changed;
+	int settling;
+	int *v; /* EDT: per worker lower envelope scratch */
+	double *z;
+	double *h;
+};
+
+static inline double segment_distance(const struct distance_field_segments *s, int k, double px, double py)
+{
+	double ex = px - s->x1[k];
+	double ey = py - s->y1[k];
+	double t = (ex * s->dx[k] + ey * s->dy[k]) * s->inv_len2[k];
+	double qx, qy;
+
+	t = t > 0.0 ? t : 0.0;
+	t = t < 1.0 ? t : 1.0;
+	qx = ex - t * s->dx[k];
+	qy = ey - t * s->dy[k];
+	return sqrt(qx * qx + qy * qy);
+}
+
+/* Does pixel p have any segments rasterized into it? */
+static inline int seeded(const struct df *df, int p)
+{
+	return df->start[p + 1] > df->start[p];
+}
+
+/* Of the segments rasterized into pixel p, the nearest to (px, py) */
+static int nearest_seed(const struct df *df, int p, double px, double py)
+{
+	int i, best = df->seed[df->start[p]];
+	double d, bestd = segment_distance(df->s, best, px, py);
+
+	for (i = df->start[p] + 1; i < df->start[p + 1]; i++) {
+		d = segment_distance(df->s, df->seed[i], px, py);
+		if (d < bestd) {
+			bestd = d;
+			best = df->seed[i];
+		}
+	}
+	return best;
+}
+
+/* List every segment in every pixel it passes through.  Keeping them all,
+ * rather than one per pixel, means a short segment lying under a longer
+ * one still gets seeded.  Called twice: first to count each pixel's
+ * segments into start[p + 1], then to fill them in, start[p] counting up.
+ */
+static void rasterize(struct df *df, double fs, int fill)
+{
+	const struct distance_field_segments *s = df->s;
+	double u0, v0, u1, v1, len, t;
+	int k, i, ix, iy, p, lastp, nsteps;
+
+	for (k = 0; k < s->n; k++) {
+		if (s->inv_len2[k] == 0.0)
+			continue;
+		u0 = s->x1[k] * fs + df->pad;
+		v0 = s->y1[k] * fs + df->pad;
+		u1 = (s->x1[k] + s->dx[k]) * fs + df->pad;
+		v1 = (s->y1[k] + s->dy[k]) * fs + df->pad;
+		len = sqrt((u1 - u0) * (u1 - u0) + (v1 - v0) * (v1 - v0));
+		nsteps = (int) ceil(len * 2.0) + 1;
+		lastp = -1;
+		for (i = 0; i <= nsteps; i++) {
+			t = (double) i / nsteps;
+			ix = (int) floor(u0 + t * (u1 - u0) + 0.5);
+			iy = (int) floor(v0 + t * (v1 - v0) + 0.5);
+			ix = ix < 0 ? 0 : ix >= df->w ? df->w - 1 : ix;
+			iy = iy < 0 ? 0 : iy >= df->w ? df->w - 1 : iy;
+			p = iy * df->w + ix;
+			if (p == lastp)
+				continue;
+			lastp = p;
+			if (fill)
+				df->seed[df->start[p]++] = k;
+			else
+				df->start[p + 1]++;
+		}
+	}
+}
+
+static void seed_pixels(struct df *df, double fs)
+{
+	int p, npixels = df->w * df->w;
+
+	df->start = calloc(npixels + 1, sizeof(*df->start));
+	rasterize(df, fs, 0);
+	for (p = 0; p < npixels; p++)
+		df->start[p + 1] += df->start[p];
+	df->seed = malloc(sizeof(*df->seed) * (df->start[npixels] + 1));
+	rasterize(df, fs, 1);
+	/* filling in moved each start[p] up to start[p + 1], move them back */
+	for (p = npixels; p > 0; p--)
+		df->start[p] = df->start[p - 1];
+	df->start[0] = 0;
+}
+
+/* EDT pass 1: for each pixel, the nearest seed in its own column.  A strip
+ * of columns at a time so the sweeps walk memory in order.
+ */
+static void edt_columns(void *arg, int strip, __attribute__((unused)) int worker)
+{
+	struct df *df = arg;
+	int x, y, p, xmin = strip * COLUMN_STRIP;
+	int xmax = xmin + COLUMN_STRIP > df->w ? df->w : xmin + COLUMN_STRIP;
+	int last[COLUMN_STRIP];
+	double d2;
+
+	for (x = xmin; x < xmax; x++)
+		last[x - xmin] = -1;
+	for (y = 0; y < df->w; y++) {
+		for (x = xmin; x < xmax; x++) {
+			p = y * df->w + x;
+			if (seeded(df, p))
+				last[x - xmin] = y;
+			if (last[x - xmin] >= 0) {
+				df->vd2[p] = (double) (y - last[x - xmin]) * (y - last[x - xmin]);
+				df->vid[p] = last[x - xmin] * df->w + x;
+			} else {
+				df->vd2[p] = NO_DISTANCE;
+				df->vid[p] = NO_SEGMENT;
+			}
+		}
+	}
+	for (x = xmin; x < xmax; x++)
+		last[x - xmin] = -1;
+	for (y = df->w - 1; y >= 0; y--) {
+		for (x = xmin; x < xmax; x++) {
+			p = y * df->w + x;
+			if (seeded(df, p))
+				last[x - xmin] = y;
+			if (last[x - xmin] < 0)
+				continue;
+			d2 = (double) (last[x - xmin] - y) * (last[x - xmin] - y);
+			if (d2 < df->vd2[p]) {
+				df->vd2[p] = d2;
+				df->vid[p] = last[x - xmin] * df->w + x;
+			}
+		}
+	}
+}
+
+/* EDT pass 2, for row y of the padded domain: the lower envelope of the
+ * parabolas (q - x)^2 + vd2[x] over the row gives each pixel its nearest
+ * seed pixel, and so the nearest of the segments rasterized into it.
+ */
+static void edt_row(void *arg, int y, int worker)
+{
+	struct df *df = arg;
+	int w = df->w, row = y * w;
+	int *v = &df->v[worker * w];
+	double *z = &df->z[worker * (w + 1)];
+	const double *f = &df->vd2[row];
+	int k = -1, q;
+	double s = 0.0;
+
+	for (q = 0; q < w; q++) {
+		if (f[q] >= NO_DISTANCE)
+			continue;
+		while (k >= 0) {
+			s = ((f[q] + (double) q * q) - (f[v[k]] + (double) v[k] * v[k])) / (2.0 * q - 2.0 * v[k]);
+			if (s > z[k])
+				break;
+			k--;
+		}
+		if (k < 0) {
+			k = 0;
+			v[0] = q;
+			z[0] = -NO_DISTANCE;
+		} else {
+			k++;
+			v[k] = q;
+			z[k] = s;
+		}
+		z[k + 1] = NO_DISTANCE;
+	}
+
+	if (k < 0) { /* not a single seed in the whole domain */
+		for (q = 0; q < w; q++)
+			df->cur[row + q] = NO_SEGMENT;
+		return;
+	}
+	k = 0;
+	for (q = 0; q < w; q++) {
+		while (z[k + 1] < q)
+			k++;
+		df->cur[row + q] = nearest_seed(df, df->vid[row + v[k]], df->coord[q], df->coord[y]);
+	}
+}
+
+/* JFA starts from each seed pixel's own nearest segment */
+static void jfa_seed_row(void *arg, int y, __attribute__((unused)) int worker)
+{
+	struct df *df = arg;
+	int x, p;
+
+	for (x = 0; x < df->w; x++) {
+		p = y * df->w + x;
+		df->cur[p] = seeded(df, p) ? nearest_seed(df, p, df->coord[x], df->coord[y]) : NO_SEGMENT;
+	}
+}
+
+/* Did the last pass change any of the 3 x 3 pixels around (x, y)? */
+static int near_moved(const struct df *df, int x, int y)
+{
+	int i, j;
+
+	for (i = y > 0 ? -1 : 0; i <= 1 && y + i < df->w; i++)
+		for (j = x > 0 ? -1 : 0; j <= 1 && x + j < df->w; j++)
+			if (df->was_moved[(y + i) * df->w + x + j])
+				return 1;
+	return 0;
+}
+
+/* One jump flooding pass over row y of the padded domain */
+static void jfa_row(void *arg, int y, __attribute__((unused)) int worker)
+{
+	struct df *df = arg;
+	int x, i, j, nx, ny, id, best, changed = 0;
+	double d, bestd, px, py = df->coord[y];
+
+	if (df->settling && !df->was_changed[y] && (y == 0 || !df->was_changed[y - 1]) &&
+		(y == df->w - 1 || !df->was_changed[y + 1])) {
+		memcpy(&df->next[y * df->w], &df->cur[y * df->w], sizeof(*df->next) * df->w);
+		memset(&df->moved[y * df->w], 0, df->w);
+		df->changed[y] = 0;
+		return;
+	}
+	for (x = 0; x < df->w; x++) {
+		if (df->settling && !near_moved(df, x, y)) {
+			df->next[y * df->w + x] = df->cur[y * df->w + x];
+			df->moved[y * df->w + x] = 0;
+			continue;
+		}
+		px = df->coord[x];
+		best = df->cur[y * df->w + x];
+		bestd = best == NO_SEGMENT ? NO_DISTANCE : segment_distance(df->s, best, px, py);
+		for (i = -1; i <= 1; i++) {
+			ny = y + i * df->step;
+			if (ny < 0 || ny >= df->w)
+				continue;
+			for (j = -1; j <= 1; j++) {
+				nx = x + j * df->step;
+				if (nx < 0 || nx >= df->w)
+					continue;
+				id = df->cur[ny * df->w + nx];
+				if (id == NO_SEGMENT || id == best)
+					continue;
+				d = segment_distance(df->s, id, px, py);
+				if (d < bestd) {
+					bestd = d;
+					best = id;
+				}
+			}
+		}
+		changed += best != df->cur[y * df->w + x];
+		if (df->moved)
+			df->moved[y * df->w + x] = best != df->cur[y * df->w + x];
+		df->next[y * df->w + x] = best;
+	}
+	df->changed[y] = changed;
+}
+
+/* Returns how many pixels found a nearer segment */
+static int jfa_pass(struct thread_pool *pool, struct df *df, int step)
+{
+	int32_t *tmp;
+	uint8_t *tmp_moved;
+	int *tmp_changed;
+	int y, changed = 0;
+
+	df->step = step;
+	thread_pool_run(pool, df->w, jfa_row, df);
+	tmp = df->cur;
+	df->cur = df->next;
+	df->next = tmp;
+	for (y = 0; y < df->w; y++)
+		changed += df->changed[y];
+	if (df->moved) {
+		tmp_moved = df->was_moved;
+		df->was_moved = df->moved;
+		df->moved = tmp_moved;
+		tmp_changed = df->was_changed;
+		df->was_changed = df->changed;
+		df->changed = tmp_changed;
+	}
+	return changed;
+}
+
+/* The height of each image pixel, from the segment found for it */
+static void heights_row(void *arg, int y, __attribute__((unused)) int worker)
+{
+	struct df *df = arg;
+	int x, id;
+
+	for (x = 0; x < df->dim; x++) {
+		id = df->cur[(y + df->pad) * df->w + x + df->pad];
+		df->h[y * df->dim + x] = id == NO_SEGMENT ? 10000.0 :
+			segment_distance(df->s, id, df->coord[x + df->pad], df->coord[y + df->pad]);
+	}
+}
+
+void distance_field(struct thread_pool *pool, enum distance_field_engine engine,
+			const struct distance_field_segments *s, int dim, double feature_size,
+			double *h)
+{
+	struct df df;
+	int i, step, nworkers = thread_pool_nthreads(pool);
+	size_t npixels;
+
+	df.s = s;
+	df.engine = engine;
+	df.dim = dim;
+	df.pad = DF_PAD;
+	df.w = dim + 2 * df.pad;
+	df.h = h;
+	npixels = (size_t) df.w * df.w;
+	df.coord = malloc(sizeof(*df.coord) * df.w);
+	for (i = 0; i < df.w; i++)
+		df.coord[i] = (double) (i - df.pad) / feature_size;
+	seed_pixels(&df, feature_size);
+	df.cur = malloc(sizeof(*df.cur) * npixels);
+	df.next = malloc(sizeof(*df.next) * npixels);
+	df.changed = malloc(sizeof(*df.changed) * df.w);
+	df.moved = NULL;
+	df.settling = 0;
+
+	if (engine == DISTANCE_FIELD_EDT) {
+		df.vid = malloc(sizeof(*df.vid) * npixels);
+		df.vd2 = malloc(sizeof(*df.vd2) * npixels);
+		df.v = malloc(sizeof(*df.v) * df.w * nworkers);
+		df.z = malloc(sizeof(*df.z) * (df.w + 1) * nworkers);
+		thread_pool_run(pool, (df.w + COLUMN_STRIP - 1) / COLUMN_STRIP, edt_columns, &df);
+		thread_pool_run(pool, df.w, edt_row, &df);
+		free(df.vid);
+		free(df.vd2);
+		free(df.v);
+		free(df.z);
+		/*
+		 * The nearest rasterized pixel can belong to a segment that is
+		 * farther away than some other one.  Each segment's region is
+		 * star shaped about it, so a pixel's nearest segment also owns the
+		 * pixels on the way to it, and letting every pixel try its
+		 * neighbors' segments until none finds a nearer one fixes them all.
+		 */
+		df.moved = malloc(npixels);
+		df.was_moved = malloc(npixels);
+		df.was_changed = malloc(sizeof(*df.was_changed) * df.w);
+		df.settling = 0;
+		while (jfa_pass(pool, &df, 1))
+			df.settling = 1;
+		free(df.moved);
+		free(df.was_moved);
+		free(df.was_changed);
+	} else {
+		thread_pool_run(pool, df.w, jfa_seed_row, &df);
+		for (step = 1; step * 2 < df.w; step *= 2)
+			;
+		/* the usual halving steps, then one more at step 1 to clean up */
+		for (; step >= 1; step /= 2)
+			jfa_pass(pool, &df, step);
+		jfa_pass(pool, &df, 1);
+	}
+	thread_pool_run(pool, dim, heights_row, &df);
+	free(df.cur);
+	free(df.next);
+	free(df.changed);
+	free(df.start);
+	free(df.seed);
+	free(df.coord);
+}
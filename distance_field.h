@@ -0,0 +1,74 @@
+#ifndef DISTANCE_FIELD_H__
+#define DISTANCE_FIELD_H__
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Distance field engines.  Instead of testing every pixel against the
+ * segments of its grid cell's neighborhood, rasterize every segment into
+ * the image once, then find the nearest segment for every pixel with a
+ * whole-image distance transform:
+ *
+ *	DISTANCE_FIELD_EDT: the separable exact Euclidean distance transform
+ *	of Felzenszwalb and Huttenlocher, extended to carry along which
+ *	rasterized pixel is nearest, and so which of the segments in it,
+ *	followed by jump flooding passes at step 1 until no pixel finds a
+ *	nearer segment, to fix up pixels whose nearest rasterized pixel is
+ *	not on their nearest segment.  Each segment's region is star shaped
+ *	about it, so the fixups reach every pixel of it, and wherever the
+ *	reference code's neighborhood holds the nearest segment the two
+ *	agree exactly.  Close to linear in the number of pixels no matter how
+ *	dense the grid is.
+ *
+ *	DISTANCE_FIELD_JFA: jump flooding, log2(size) passes, each pixel
+ *	looking at its 8 neighbors at the current step.  Approximate.
+ *
+ * Either way the height of a pixel is then the exact distance to the
+ * segment found for it, so the only error JFA makes is in picking the
+ * segment.  That happens near the boundary between two segments' regions,
+ * where the two distances are nearly equal anyway.  Since these look at every
+ * segment rather than a fixed neighborhood, they can also find a nearer
+ * segment than the reference code does.
+ */
+
+struct thread_pool;
+
+enum distance_field_engine {
+	DISTANCE_FIELD_EDT,
+	DISTANCE_FIELD_JFA,
+};
+
+/* Segments, in the coordinates of the grid (pixel / feature_size).  Entries
+ * with inv_len2 == 0 (null segments) are skipped.
+ */
+struct distance_field_segments {
+	int n;
+	const double *x1, *y1, *dx, *dy, *inv_len2;
+};
+
+/* Fill h[dim * dim] with the distance of each pixel (x / feature_size,
+ * y / feature_size) to its nearest segment, or 10000.0 if there are none.
+ */
+void distance_field(struct thread_pool *pool, enum distance_field_engine engine,
+			const struct distance_field_segments *s, int dim, double feature_size,
+			double *h);
+
+#endif
@@ -0,0 +1,379 @@
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * This file must be compiled with -ffp-contract=off, otherwise the compiler
+ * is free to fuse multiplies and adds differently in each variant, and the
+ * variants would no longer agree bit for bit.
+ */
+
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#include "erosion_kernel.h"
+
+#define NO_SEGMENT_D2 (10000.0 * 10000.0)
+
+/* Per row values: ey = py - y1 and ey * dy for each segment */
+struct row_terms {
+	double ey[EROSION_MAX_SEGMENTS];
+	double eydy[EROSION_MAX_SEGMENTS];
+};
+
+static inline void compute_row_terms(const struct erosion_segments *s, double py, struct row_terms *r)
+{
+	int i;
+
+	for (i = 0; i < s->n; i++) {
+		r->ey[i] = py - s->y1[i];
+		r->eydy[i] = r->ey[i] * s->dy[i];
+	}
+}
+
+/* Squared distance from pixel px on the current row to segment i, branch
+ * free.  The SIMD versions below mirror this operation for operation.
+ */
+static inline double segment_d2(const struct erosion_segments *s, const struct row_terms *r,
+				int i, double px)
+{
+	double ex, t, qx, qy;
+
+	ex = px - s->x1[i];
+	t = (ex * s->dx[i] + r->eydy[i]) * s->inv_len2[i];
+	t = t > 0.0 ? t : 0.0;
+	t = t < 1.0 ? t : 1.0;
+	qx = ex - t * s->dx[i];
+	qy = r->ey[i] - t * s->dy[i];
+	return qx * qx + qy * qy;
+}
+
+static inline void row_scalar(const struct erosion_segments *s, const struct row_terms *r,
+				const double *px, int n, double *h)
+{
+	int i, j;
+	double best, d2;
+
+	for (j = 0; j < n; j++) {
+		best = NO_SEGMENT_D2;
+		for (i = 0; i < s->n; i++) {
+			d2 = segment_d2(s, r, i, px[j]);
+			best = d2 < best ? d2 : best;
+		}
+		h[j] = sqrt(best);
+	}
+}
+
+static void erosion_block_scalar(const struct erosion_segments *s,
+				const double *px, int nx, const double *py, int ny,
+				double *h, int hstride)
+{
+	struct row_terms r;
+	int row;
+
+	for (row = 0; row < ny; row++) {
+		compute_row_terms(s, py[row], &r);
+		row_scalar(s, &r, px, nx, &h[row * hstride]);
+	}
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/*
+ * The vector kernels broadcast the segments once per block and the row
+ * terms once per row, so the inner loop over pixels touches nothing but
+ * registers and the px array.
+ */
+
+/* SSE2 is part of x86-64, so this one needs no target attribute there */
+__attribute__((target("sse2")))
+static void erosion_block_sse2(const struct erosion_segments *s,
+				const double *px, int nx, const double *py, int ny,
+				double *h, int hstride)
+{
+	int i, j, row;
+	struct row_terms r;
+	const __m128d zero = _mm_setzero_pd();
+	const __m128d one = _mm_set1_pd(1.0);
+	__m128d x1[EROSION_MAX_SEGMENTS], dx[EROSION_MAX_SEGMENTS], dy[EROSION_MAX_SEGMENTS];
+	__m128d inv[EROSION_MAX_SEGMENTS], ey[EROSION_MAX_SEGMENTS], eydy[EROSION_MAX_SEGMENTS];
+
+	for (i = 0; i < s->n; i++) {
+		x1[i] = _mm_set1_pd(s->x1[i]);
+		dx[i] = _mm_set1_pd(s->dx[i]);
+		dy[i] = _mm_set1_pd(s->dy[i]);
+		inv[i] = _mm_set1_pd(s->inv_len2[i]);
+	}
+	for (row = 0; row < ny; row++) {
+		double *hrow = &h[row * hstride];
+
+		compute_row_terms(s, py[row], &r);
+		for (i = 0; i < s->n; i++) {
+			ey[i] = _mm_set1_pd(r.ey[i]);
+			eydy[i] = _mm_set1_pd(r.eydy[i]);
+		}
+		for (j = 0; j + 2 <= nx; j += 2) {
+			__m128d vpx = _mm_loadu_pd(&px[j]);
+			__m128d best = _mm_set1_pd(NO_SEGMENT_D2);
+			for (i = 0; i < s->n; i++) {
+				__m128d ex = _mm_sub_pd(vpx, x1[i]);
+				__m128d t = _mm_add_pd(_mm_mul_pd(ex, dx[i]), eydy[i]);
+				__m128d qx, qy;
+
+				t = _mm_mul_pd(t, inv[i]);
+				t = _mm_min_pd(_mm_max_pd(t, zero), one);
+				qx = _mm_sub_pd(ex, _mm_mul_pd(t, dx[i]));
+				qy = _mm_sub_pd(ey[i], _mm_mul_pd(t, dy[i]));
+				best = _mm_min_pd(_mm_add_pd(_mm_mul_pd(qx, qx), _mm_mul_pd(qy, qy)), best);
+			}
+			_mm_storeu_pd(&hrow[j], _mm_sqrt_pd(best));
+		}
+		if (j < nx)
+			row_scalar(s, &r, px + j, nx - j, hrow + j);
+	}
+}
+
+__attribute__((target("avx2")))
+static void erosion_block_avx2(const struct erosion_segments *s,
+				const double *px, int nx, const double *py, int ny,
+				double *h, int hstride)
+{
+	int i, j, row;
+	struct row_terms r;
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d one = _mm256_set1_pd(1.0);
+	__m256d x1[EROSION_MAX_SEGMENTS], dx[EROSION_MAX_SEGMENTS], dy[EROSION_MAX_SEGMENTS];
+	__m256d inv[EROSION_MAX_SEGMENTS], ey[EROSION_MAX_SEGMENTS], eydy[EROSION_MAX_SEGMENTS];
+
+	for (i = 0; i < s->n; i++) {
+		x1[i] = _mm256_set1_pd(s->x1[i]);
+		dx[i] = _mm256_set1_pd(s->dx[i]);
+		dy[i] = _mm256_set1_pd(s->dy[i]);
+		inv[i] = _mm256_set1_pd(s->inv_len2[i]);
+	}
+	for (row = 0; row < ny; row++) {
+		double *hrow = &h[row * hstride];
+
+		compute_row_terms(s, py[row], &r);
+		for (i = 0; i < s->n; i++) {
+			ey[i] = _mm256_set1_pd(r.ey[i]);
+			eydy[i] = _mm256_set1_pd(r.eydy[i]);
+		}
+		for (j = 0; j + 4 <= nx; j += 4) {
+			__m256d vpx = _mm256_loadu_pd(&px[j]);
+			__m256d best = _mm256_set1_pd(NO_SEGMENT_D2);
+			for (i = 0; i < s->n; i++) {
+				__m256d ex = _mm256_sub_pd(vpx, x1[i]);
+				__m256d t = _mm256_add_pd(_mm256_mul_pd(ex, dx[i]), eydy[i]);
+				__m256d qx, qy;
+
+				t = _mm256_mul_pd(t, inv[i]);
+				t = _mm256_min_pd(_mm256_max_pd(t, zero), one);
+				qx = _mm256_sub_pd(ex, _mm256_mul_pd(t, dx[i]));
+				qy = _mm256_sub_pd(ey[i], _mm256_mul_pd(t, dy[i]));
+				best = _mm256_min_pd(_mm256_add_pd(_mm256_mul_pd(qx, qx), _mm256_mul_pd(qy, qy)), best);
+			}
+			_mm256_storeu_pd(&hrow[j], _mm256_sqrt_pd(best));
+		}
+		if (j < nx)
+			row_scalar(s, &r, px + j, nx - j, hrow + j);
+	}
+}
+
+__attribute__((target("avx512f")))
+static void erosion_block_avx512(const struct erosion_segments *s,
+				const double *px, int nx, const double *py, int ny,
+				double *h, int hstride)
+{
+	int i, j, row;
+	struct row_terms r;
+	const __m512d zero = _mm512_setzero_pd();
+	const __m512d one = _mm512_set1_pd(1.0);
+	__m512d x1[EROSION_MAX_SEGMENTS], dx[EROSION_MAX_SEGMENTS], dy[EROSION_MAX_SEGMENTS];
+	__m512d inv[EROSION_MAX_SEGMENTS], ey[EROSION_MAX_SEGMENTS], eydy[EROSION_MAX_SEGMENTS];
+
+	for (i = 0; i < s->n; i++) {
+		x1[i] = _mm512_set1_pd(s->x1[i]);
+		dx[i] = _mm512_set1_pd(s->dx[i]);
+		dy[i] = _mm512_set1_pd(s->dy[i]);
+		inv[i] = _mm512_set1_pd(s->inv_len2[i]);
+	}
+	for (row = 0; row < ny; row++) {
+		double *hrow = &h[row * hstride];
+
+		compute_row_terms(s, py[row], &r);
+		for (i = 0; i < s->n; i++) {
+			ey[i] = _mm512_set1_pd(r.ey[i]);
+			eydy[i] = _mm512_set1_pd(r.eydy[i]);
+		}
+		for (j = 0; j < nx; j += 8) {
+			/* Masked loads and stores take care of the tail */
+			__mmask8 m = nx - j >= 8 ? 0xff : (__mmask8) ((1u << (nx - j)) - 1);
+			__m512d vpx = _mm512_maskz_loadu_pd(m, &px[j]);
+			__m512d best = _mm512_set1_pd(NO_SEGMENT_D2);
+			for (i = 0; i < s->n; i++) {
+				__m512d ex = _mm512_sub_pd(vpx, x1[i]);
+				__m512d t = _mm512_add_pd(_mm512_mul_pd(ex, dx[i]), eydy[i]);
+				__m512d qx, qy;
+
+				t = _mm512_mul_pd(t, inv[i]);
+				t = _mm512_min_pd(_mm512_max_pd(t, zero), one);
+				qx = _mm512_sub_pd(ex, _mm512_mul_pd(t, dx[i]));
+				qy = _mm512_sub_pd(ey[i], _mm512_mul_pd(t, dy[i]));
+				best = _mm512_min_pd(_mm512_add_pd(_mm512_mul_pd(qx, qx), _mm512_mul_pd(qy, qy)), best);
+			}
+			_mm512_mask_storeu_pd(&hrow[j], m, _mm512_sqrt_pd(best));
+		}
+	}
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+/*
+ * Forward differencing ("scanline") kernel.  Along a row, for each segment,
+ * the projection t = -f1 and the signed numerator of f2 (the cross product)
+ * are affine in px, and the squared distances to the two endpoints are
+ * quadratic in px, so all four can be stepped from one pixel to the next
+ * with additions only.  They are recomputed from scratch ("re-anchored")
+ * every SCANLINE_REANCHOR pixels so rounding errors can't build up.
+ *
+ * This assumes the px[] are evenly spaced, which they are to within an ulp
+ * or so.  The result is not bit for bit identical to the reference; with
+ * re-anchoring every 32 pixels the height error stays below 1e-9 (measured
+ * with -E at image sizes up to 4096, typically around 1e-12), far below
+ * the 1 / 127.5 resolution of the output, but an occasional pixel sitting
+ * right on a quantization boundary may come out one level different.
+ */
+#define SCANLINE_REANCHOR 32
+
+static void erosion_block_scanline(const struct erosion_segments *s,
+				const double *px, int nx, const double *py, int ny,
+				double *h, int hstride)
+{
+	int i, j, j0, jend, row;
+	double step = nx > 1 ? px[1] - px[0] : 0.0;
+	double ddist = 2.0 * step * step;
+	double ex, ey, ex2, ey2, best, d2;
+	double t[EROSION_MAX_SEGMENTS], dt[EROSION_MAX_SEGMENTS];
+	double cross[EROSION_MAX_SEGMENTS], dcross[EROSION_MAX_SEGMENTS];
+	double e1[EROSION_MAX_SEGMENTS], de1[EROSION_MAX_SEGMENTS];
+	double e2[EROSION_MAX_SEGMENTS], de2[EROSION_MAX_SEGMENTS];
+
+	for (row = 0; row < ny; row++) {
+		double *hrow = &h[row * hstride];
+
+		for (j0 = 0; j0 < nx; j0 = jend) {
+			jend = j0 + SCANLINE_REANCHOR < nx ? j0 + SCANLINE_REANCHOR : nx;
+			for (i = 0; i < s->n; i++) { /* anchor */
+				ex = px[j0] - s->x1[i];
+				ey = py[row] - s->y1[i];
+				ex2 = ex - s->dx[i];
+				ey2 = ey - s->dy[i];
+				t[i] = (ex * s->dx[i] + ey * s->dy[i]) * s->inv_len2[i];
+				dt[i] = step * s->dx[i] * s->inv_len2[i];
+				cross[i] = ex * s->dy[i] - ey * s->dx[i];
+				dcross[i] = step * s->dy[i];
+				e1[i] = ex * ex + ey * ey;
+				de1[i] = 2.0 * ex * step + step * step;
+				e2[i] = ex2 * ex2 + ey2 * ey2;
+				de2[i] = 2.0 * ex2 * step + step * step;
+			}
+			for (j = j0; j < jend; j++) {
+				best = NO_SEGMENT_D2;
+				for (i = 0; i < s->n; i++) {
+					if (t[i] <= 0.0)
+						d2 = e1[i];
+					else if (t[i] >= 1.0)
+						d2 = e2[i];
+					else
+						d2 = cross[i] * cross[i] * s->inv_len2[i];
+					best = d2 < best ? d2 : best;
+					t[i] += dt[i];
+					cross[i] += dcross[i];
+					e1[i] += de1[i];
+					de1[i] += ddist;
+					e2[i] += de2[i];
+					de2[i] += ddist;
+				}
+				hrow[j] = sqrt(best);
+			}
+		}
+	}
+}
+
+static const struct {
+	const char *name;
+	erosion_block_fn fn;
+	const char *cpu_feature;
+} erosion_kernels[] = {
+	/* widest first, "auto" picks the first one the cpu supports */
+#ifdef HAVE_X86_KERNELS
+	{ "avx512", erosion_block_avx512, "avx512f" },
+	{ "avx2", erosion_block_avx2, "avx2" },
+	{ "sse2", erosion_block_sse2, "sse2" },
+#endif
+	{ "scalar", erosion_block_scalar, NULL },
+	/* not exact, only by name, never picked by "auto" */
+	{ "scanline", erosion_block_scanline, NULL },
+};
+
+#define ARRAYSIZE(x) (sizeof((x)) / sizeof((x)[0]))
+
+static int cpu_supports(const char *feature)
+{
+	if (!feature)
+		return 1;
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (strcmp(feature, "avx512f") == 0)
+		return __builtin_cpu_supports("avx512f");
+	if (strcmp(feature, "avx2") == 0)
+		return __builtin_cpu_supports("avx2");
+	if (strcmp(feature, "sse2") == 0)
+		return __builtin_cpu_supports("sse2");
+#endif
+	return 0;
+}
+
+erosion_block_fn erosion_kernel_select(const char *name, const char **chosen)
+{
+	int i, any = strcmp(name, "auto") == 0;
+
+	for (i = 0; i < (int) ARRAYSIZE(erosion_kernels); i++) {
+		if (!any && strcmp(name, erosion_kernels[i].name) != 0)
+			continue;
+		if (any && erosion_kernels[i].fn == erosion_block_scanline)
+			break;
+		if (!cpu_supports(erosion_kernels[i].cpu_feature)) {
+			if (any)
+				continue;
+			return NULL;
+		}
+		if (chosen)
+			*chosen = erosion_kernels[i].name;
+		return erosion_kernels[i].fn;
+	}
+	return NULL;
+}
@@ -0,0 +1,68 @@
+#ifndef EROSION_KERNEL_H__
+#define EROSION_KERNEL_H__
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Vectorized point to segment distance kernels.
+ *
+ * For a block of pixels that all lie in the same grid cell, the candidate
+ * segments are the same for every pixel: segment i runs from (x1, y1)
+ * to (x1 + dx, y1 + dy).  Degenerate segments (a grid point connected to
+ * itself) never contribute to the height in the reference code (f1 is
+ * NaN there), so they must be left out of the set, or replaced with a
+ * segment so far away that it can never be the nearest.
+ *
+ * Instead of the three way f1 branch, the kernels clamp the projection
+ * t = -f1 to [0, 1] and measure the distance to p1 + t * d, which is the
+ * same quantity without any data dependent branches.  All variants do
+ * exactly the same IEEE operations in the same order, so the scalar,
+ * SSE2, AVX2 and AVX-512 versions produce identical results.
+ */
+
+#define EROSION_MAX_SEGMENTS 49 /* a 7 x 7 neighborhood */
+
+struct erosion_segments {
+	int n;
+	double x1[EROSION_MAX_SEGMENTS];
+	double y1[EROSION_MAX_SEGMENTS];
+	double dx[EROSION_MAX_SEGMENTS];
+	double dy[EROSION_MAX_SEGMENTS];
+	double inv_len2[EROSION_MAX_SEGMENTS];
+};
+
+/* For the nx by ny block of pixels at (px[i], py[j]), store the distance
+ * to the nearest segment in h[j * hstride + i], or 10000.0 if there are
+ * no segments.  A single row span is just ny == 1.
+ */
+typedef void (*erosion_block_fn)(const struct erosion_segments *s,
+				const double *px, int nx, const double *py, int ny,
+				double *h, int hstride);
+
+/* Look up a kernel by name: "scalar", "sse2", "avx2", "avx512", or "auto"
+ * for the widest one this cpu supports, or "scanline" for the forward
+ * differencing kernel, which is not exact (see erosion_kernel.c).  Returns NULL if the name is
+ * unknown or the cpu can't run it.  *chosen, if not NULL, gets the
+ * name of the kernel actually selected.
+ */
+erosion_block_fn erosion_kernel_select(const char *name, const char **chosen);
+
+#endif
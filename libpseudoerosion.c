@@ -0,0 +1,2769 @@
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <ctype.h>
+#include <stdatomic.h>
+#include <errno.h>
+
+#include "open-simplex-noise.h"
+#include "thread_pool.h"
+#include "erosion_kernel.h"
+#include "distance_field.h"
+#include "combine.h"
+#include "task_graph.h"
+#include "arena.h"
+#include "stage_cache.h"
+#include "noise_slice.h"
+#include "libpseudoerosion.h"
+
+typedef pseudo_erosion_height height_t;
+
+#define MAX_ITERATIONS PSEUDO_EROSION_MAX_ITERATIONS
+#define MAX_NEIGHBORHOOD_RADIUS PSEUDO_EROSION_MAX_RADIUS
+
+struct grid_point {
+	double x, y;
+	int cx, cy; /* connected to gridpoint(grid, cx, cy) */
+};
+
+/*
+ * The segment from each grid point to the point it is connected to, derived
+ * from the grid points by build_segment() and stored as a structure of
+ * cache aligned arrays for the span kernels.  There is a halo as wide as the
+ * neighborhood radius all the way around filled with null segments, as are
+ * the entries for points connected to themselves.  A null segment lies so
+ * far away that it can never be the nearest one, so the kernels need no
+ * bounds checks and no special cases.
+ */
+#define NULL_SEGMENT_COORD (1.0e9)
+
+struct segment_table {
+	int halo, stride;
+	double *x1, *y1, *x2, *y2;
+	double *dx, *dy; /* x2 - x1, y2 - y1 */
+	double *inv_len2, *inv_len; /* 1 / squared length, 1 / length */
+	void *mem;
+};
+
+struct grid {
+	struct grid_point *g;
+	double *height; /* of each point, laid out like g, found once before connecting them */
+	int dim;
+	struct segment_table seg;
+};
+
+static void allocate_segment_table(struct segment_table *t, int dim, int halo)
+{
+	int i, n;
+	size_t asize;
+	double **array[] = { &t->x1, &t->y1, &t->x2, &t->y2, &t->dx, &t->dy, &t->inv_len2, &t->inv_len };
+	const int narrays = sizeof(array) / sizeof(array[0]);
+
+	t->halo = halo;
+	t->stride = dim + 1 + 2 * t->halo;
+	n = t->stride * t->stride;
+	asize = (sizeof(double) * n + 63) & ~(size_t) 63;
+	if (posix_memalign(&t->mem, 64, asize * narrays)) {
+		fprintf(stderr, "pseudo_erosion: out of memory allocating segment table\n");
+		exit(1);
+	}
+	for (i = 0; i < narrays; i++)
+		*array[i] = (double *) ((char *) t->mem + asize * i);
+}
+
+/* A grid dim cells across, its segment table good for a neighborhood radius of up to halo */
+static struct grid *allocate_grid(int dim, int halo)
+{
+	struct grid_point *gp;
+	struct grid *g;
+
+	gp = malloc(sizeof(*gp) * (dim + 1) * (dim + 1));
+	memset(gp, 0,  sizeof(*gp) * (dim + 1) * (dim + 1));
+	g = malloc(sizeof(*g));
+	g->g = gp;
+	g->height = malloc(sizeof(*g->height) * (dim + 1) * (dim + 1));
+	g->dim = dim;
+	allocate_segment_table(&g->seg, dim, halo);
+	return g;
+}
+
+static void free_grid(struct grid *grid)
+{
+	free(grid->seg.mem);
+	free(grid->height);
+	free(grid->g);
+	grid->g = NULL;
+	free(grid);
+}
+
+static inline struct grid_point *gridpoint(struct grid *grid, int x, int y)
+{
+	return &grid->g[(grid->dim + 1) * y + x];
+}
+
+/* Index into grid->seg of the segment starting at grid point (x, y), -halo <= x, y <= dim + halo */
+static inline int segment_index(struct grid *grid, int x, int y)
+{
+	return (y + grid->seg.halo) * grid->seg.stride + x + grid->seg.halo;
+}
+
+static inline double sqr(double x)
+{
+	return x * x;
+}
+
+/* Fill in the segment table entry for grid point (x, y), -halo <= x, y <= dim + halo */
+static void build_segment(struct grid *grid, int x, int y)
+{
+	struct segment_table *t = &grid->seg;
+	struct grid_point *p1, *p2;
+	double len2;
+	int k;
+
+	k = segment_index(grid, x, y);
+	len2 = 0.0;
+	if (x >= 0 && y >= 0 && x <= grid->dim && y <= grid->dim) {
+		p1 = gridpoint(grid, x, y);
+		p2 = gridpoint(grid, p1->cx, p1->cy);
+		len2 = sqr(p1->y - p2->y) + sqr(p1->x - p2->x);
+	}
+	if (len2 == 0.0) { /* halo, or connected to itself */
+		t->x1[k] = t->x2[k] = NULL_SEGMENT_COORD;
+		t->y1[k] = t->y2[k] = NULL_SEGMENT_COORD;
+		t->dx[k] = t->dy[k] = 0.0;
+		t->inv_len2[k] = t->inv_len[k] = 0.0;
+		return;
+	}
+	t->x1[k] = p1->x;
+	t->y1[k] = p1->y;
+	t->x2[k] = p2->x;
+	t->y2[k] = p2->y;
+	t->dx[k] = p2->x - p1->x;
+	t->dy[k] = p2->y - p1->y;
+	t->inv_len2[k] = 1.0 / len2;
+	t->inv_len[k] = 1.0 / sqrt(len2);
+}
+
+/* Offsets for Moore neighborhood, including self */
+static const int xo[] = { -1, 0, 1, 1, 1, 0, -1, -1, 0 };
+static const int yo[] = { -1, -1, -1, 0, 1, 1, 1, 0, 0 };
+
+/*
+ * The planes through the noise grids take it from: the points are
+ * jittered by 3D noise at z = 25.7 across and z = 95.9 down, and their
+ * heights are 4D noise at z = w = 0.  Exact unless the params ask for
+ * noise_lattice samples per unit, see noise_slice.h.
+ */
+enum { NOISE_JITTER_X, NOISE_JITTER_Y, NOISE_HEIGHT, NOISE_SLICES };
+
+static const struct {
+	int dims;
+	double z, w;
+} noise_slice_at[NOISE_SLICES] = {
+	{ 3, 25.7, 0.0 },
+	{ 3, 95.9, 0.0 },
+	{ 4, 0.0, 0.0 },
+};
+
+struct grid_noise {
+	struct osn_context *ctx;
+	int density;
+	struct noise_slice *slice[NOISE_SLICES];
+};
+
+/*
+ * Grids are built a row of grid points at a time, spread over a pool, in
+ * passes: place the points, jittered by the noise, then find each point's
+ * height just once into grid->height, then connect each point to its
+ * lowest neighbor going by those, and last fill in the segment table.
+ */
+struct grid_job {
+	const struct grid_noise *noise;
+	struct grid *grid;
+	double dim, feature_size;
+	const height_t *image;
+	int stride;
+};
+
+/* Grid points per call to noise_slice_eval() */
+#define NOISE_CHUNK 64
+
+static void place_grid_row(void *arg, int y, __attribute__((unused)) int worker)
+{
+	struct grid_job *gj = arg;
+	struct grid *grid = gj->grid;
+	const double dim = gj->dim, feature_size = gj->feature_size;
+	double ox[NOISE_CHUNK], oy[NOISE_CHUNK], xnoise[NOISE_CHUNK], ynoise[NOISE_CHUNK];
+	int x, i, n;
+
+	for (x = 0; x < grid->dim + 1; x += n) {
+		n = grid->dim + 1 - x < NOISE_CHUNK ? grid->dim + 1 - x : NOISE_CHUNK;
+		for (i = 0; i < n; i++) {
+			ox[i] = ((double) (x + i) * dim / (double) grid->dim / feature_size);
+			oy[i] = ((double) y * dim / (double) grid->dim / feature_size);
+		}
+		noise_slice_eval(gj->noise->slice[NOISE_JITTER_X], ox, oy, xnoise, n);
+		noise_slice_eval(gj->noise->slice[NOISE_JITTER_Y], ox, oy, ynoise, n);
+		for (i = 0; i < n; i++) {
+			gridpoint(grid, x + i, y)->x = ox[i] + 0.5 * xnoise[i] * dim / grid->dim / feature_size;
+			gridpoint(grid, x + i, y)->y = oy[i] + 0.5 * ynoise[i] * dim / grid->dim / feature_size;
+		}
+	}
+}
+
+/* Place the grid points, jittered by noise, feature_size pixels per unit */
+static void place_grid_points(struct thread_pool *pool, const struct grid_noise *noise, struct grid *grid,
+				const double dim, const double feature_size)
+{
+	struct grid_job gj;
+
+	gj.noise = noise;
+	gj.grid = grid;
+	gj.dim = dim;
+	gj.feature_size = feature_size;
+	thread_pool_run(pool, grid->dim + 1, place_grid_row, &gj);
+}
+
+/* Index of the pixel of image a grid point at (px, py) takes its height from */
+static int image_sample_index(const double dim, double px, double py)
+{
+	int index = (int) (py * dim + px);
+
+	/*
+	 * Jittered points near the edge can land just outside the image.
+	 * The original code read past the buffer there, so clamping changes
+	 * the output for those points and everything they connect to.
+	 */
+	if (index < 0)
+		index = 0;
+	if (index >= (int) dim * (int) dim)
+		index = (int) dim * (int) dim - 1;
+	return index;
+}
+
+/* The height of grid point (x, y): from the noise, or from image (rows stride apart) if there is one */
+static double grid_point_height(const struct grid_noise *noise, struct grid *grid, int x, int y,
+		const double dim, const height_t *image, int stride)
+{
+	double px = gridpoint(grid, x, y)->x;
+	double py = gridpoint(grid, x, y)->y;
+	double h;
+	int k;
+
+	if (image) {
+		k = image_sample_index(dim, px, py);
+		return image[(k / (int) dim) * stride + k % (int) dim];
+	}
+	noise_slice_eval(noise->slice[NOISE_HEIGHT], &px, &py, &h, 1);
+	return h;
+}
+
+static void grid_height_row(void *arg, int y, __attribute__((unused)) int worker)
+{
+	struct grid_job *gj = arg;
+	struct grid *grid = gj->grid;
+	double *height = &grid->height[(grid->dim + 1) * y];
+	double px[NOISE_CHUNK], py[NOISE_CHUNK];
+	int x, i, n;
+
+	if (gj->image) {
+		for (x = 0; x < grid->dim + 1; x++)
+			height[x] = grid_point_height(gj->noise, grid, x, y, gj->dim, gj->image, gj->stride);
+		return;
+	}
+	for (x = 0; x < grid->dim + 1; x += n) {
+		n = grid->dim + 1 - x < NOISE_CHUNK ? grid->dim + 1 - x : NOISE_CHUNK;
+		for (i = 0; i < n; i++) {
+			px[i] = gridpoint(grid, x + i, y)->x;
+			py[i] = gridpoint(grid, x + i, y)->y;
+		}
+		noise_slice_eval(gj->noise->slice[NOISE_HEIGHT], px, py, &height[x], n);
+	}
+}
+
+/* Find the height of every grid point, from the noise, or from image if not NULL */
+static void grid_point_heights(struct thread_pool *pool, const struct grid_noise *noise, struct grid *grid,
+				const double dim, const height_t *image, int stride)
+{
+	struct grid_job gj;
+
+	gj.noise = noise;
+	gj.grid = grid;
+	gj.dim = dim;
+	gj.image = image;
+	gj.stride = stride;
+	thread_pool_run(pool, grid->dim + 1, grid_height_row, &gj);
+}
+
+/* Connect grid point (x, y) to its lowest neighbor, (possibly itself) */
+static void connect_grid_point(struct grid *grid, int x, int y)
+{
+	int i, lown = -1;
+	double lowest_value = 100000.0;
+
+	/* Find the lowest neighbor, lown (index into xo[], yo[]) */
+	for (i = 0; i < 9; i++) { /* Check Moore neighborhood */
+		int nx, ny;
+		double value;
+		nx = x + xo[i];
+		ny = y + yo[i];
+		if (nx < 0 || nx > grid->dim || ny < 0 || ny > grid->dim)
+			continue;
+		value = grid->height[(grid->dim + 1) * ny + nx];
+		if (value < lowest_value) {
+			lown = i;
+			lowest_value = value;
+		}
+	}
+	/* Set the connection to lowest neighbor */
+	gridpoint(grid, x, y)->cx = x + xo[lown];
+	gridpoint(grid, x, y)->cy = y + yo[lown];
+}
+
+static void connect_grid_row(void *arg, int y, __attribute__((unused)) int worker)
+{
+	struct grid_job *gj = arg;
+	int x;
+
+	for (x = 0; x < gj->grid->dim + 1; x++)
+		connect_grid_point(gj->grid, x, y);
+}
+
+static void build_segment_row(void *arg, int y, __attribute__((unused)) int worker)
+{
+	struct grid_job *gj = arg;
+	struct grid *grid = gj->grid;
+	int x;
+
+	y -= grid->seg.halo;
+	for (x = -grid->seg.halo; x <= grid->dim + grid->seg.halo; x++)
+		build_segment(grid, x, y);
+}
+
+/* Connect the grid points, their heights already found, and fill in the segment table */
+static void connect_grid_points(struct thread_pool *pool, struct grid *grid)
+{
+	struct grid_job gj;
+
+	gj.grid = grid;
+	thread_pool_run(pool, grid->dim + 1, connect_grid_row, &gj);
+	thread_pool_run(pool, grid->dim + 1 + 2 * grid->seg.halo, build_segment_row, &gj);
+}
+
+/* Set up the connections and segments of a placed grid, heights coming from the noise, or from image if not NULL */
+static void connect_grid(struct thread_pool *pool, const struct grid_noise *noise, struct grid *grid,
+			const double dim, const height_t *image, int stride)
+{
+	grid_point_heights(pool, noise, grid, dim, image, stride);
+	connect_grid_points(pool, grid);
+}
+
+static const struct pseudo_erosion_pipeline builtin_pipeline = {
+	5, {
+		{ 1, 1, 0, "" },
+		{ 2, 2, 0, COMBINE_F1 },
+		{ 4, 4, 1, COMBINE_F2 },
+		{ 8, 8, 1, COMBINE_F3 },
+		{ 16, 16, 1, COMBINE_F4 },
+	},
+};
+
+static const struct pseudo_erosion_pipeline *pipeline(const struct pseudo_erosion_params *p)
+{
+	return p->pipeline ? p->pipeline : &builtin_pipeline;
+}
+
+/*
+ * An iteration's combine step, fused into erode_layer() so that each
+ * pixel is combined as soon as its height is known, while it is still in
+ * cache, instead of in another sweep over whole images afterwards.
+ * acc = prog(prev, new height, layers), prev may be the same as acc.
+ */
+struct combine_step {
+	const struct combine_program *prog;
+	height_t *acc;
+	const height_t *prev;
+	const height_t *const *layer; /* every iteration's, for the ones expr uses */
+};
+
+#define TILE_SIZE 64
+
+/* What a call into the library runs with: its parameters, with the kernel
+ * looked up, and the pool and noise to use.
+ */
+struct run {
+	const struct pseudo_erosion_params *p;
+	struct thread_pool *pool;
+	struct grid_noise *noise;
+	erosion_block_fn kernel; /* NULL means use the reference code */
+	const char *kernel_name; /* of the kernel actually chosen */
+};
+
+struct erosion_job {
+	const struct run *run;
+	const char *name; /* of the kernel or engine, for error_report() */
+	struct thread_pool *pool;
+	height_t *image; /* the layer, or NULL if it's only needed for the combine step */
+	const struct combine_step *combine; /* NULL if not fused */
+	struct grid *grid;
+	int dim;
+	int stride; /* of image and the combine step's images */
+	float feature_size;
+	erosion_block_fn kernel;
+	double *coord; /* coord[x] = x / feature_size, for the block kernels */
+	double *heights; /* if not NULL, unquantized kernel output, for error_report() */
+	struct candidates *cand;
+	int tiles_across; /* tile traversal */
+	int blocks_per_cell; /* cell traversal */
+	const int *cells; /* if not NULL, only these cells are computed, cell traversal only */
+	int ntasks;
+	int quiet; /* no progress dots, whoever runs the tasks prints its own */
+	atomic_int tasks_done;
+	atomic_int dots_printed;
+};
+
+/* Print one dot per image row's worth of finished tasks.  Whichever worker
+ * pushes the count past the next dot claims and prints it, nobody waits.
+ */
+static void erosion_progress(struct erosion_job *job)
+{
+	int done, want, printed;
+
+	if (!job->run->p->verbose || job->quiet)
+		return;
+	done = atomic_fetch_add(&job->tasks_done, 1) + 1;
+	want = (int) ((int64_t) done * job->dim / job->ntasks);
+	printed = atomic_load(&job->dots_printed);
+	while (printed < want) {
+		if (atomic_compare_exchange_weak(&job->dots_printed, &printed, want)) {
+			for (; printed < want; printed++)
+				putchar('.');
+			fflush(stdout);
+			break;
+		}
+	}
+}
+
+/* First pixel (in x or y) that falls in grid cell c */
+static inline int cell_start(struct grid *grid, int dim, int c)
+{
+	return (int) (((int64_t) c * dim + grid->dim - 1) / grid->dim);
+}
+
+/*
+ * Candidate culling.  For each grid cell we look at the segments starting at
+ * every grid point within neighborhood_radius of the cell, and throw out
+ * those that can't be nearest to any pixel of the cell: if the closest a
+ * segment gets to the cell's rectangle is farther than the farthest some
+ * other segment gets from it (the farthest corner, distance to a segment
+ * being convex), that other segment always wins.  This is conservative, so
+ * the minimum, and so the output, is exactly what testing every segment in
+ * the neighborhood would give.  The survivors are stored per cell as small
+ * offsets into the neighborhood.
+ */
+#define MAX_NEIGHBORS ((2 * MAX_NEIGHBORHOOD_RADIUS + 1) * (2 * MAX_NEIGHBORHOOD_RADIUS + 1))
+
+struct candidates {
+	int nneighbors;
+	int offset[MAX_NEIGHBORS]; /* neighborhood, as offsets into the segment table */
+	uint8_t *count; /* per cell */
+	uint8_t *which; /* per cell, nneighbors entries, indices into offset[] */
+	struct grid *grid;
+	const double *coord;
+	int dim;
+	const int *cells;
+};
+
+static double point_segment_distance(const struct segment_table *t, int k, double px, double py)
+{
+	double ex = px - t->x1[k];
+	double ey = py - t->y1[k];
+	double u = (ex * t->dx[k] + ey * t->dy[k]) * t->inv_len2[k];
+
+	u = u > 0.0 ? u : 0.0;
+	u = u < 1.0 ? u : 1.0;
+	return sqrt(sqr(ex - u * t->dx[k]) + sqr(ey - u * t->dy[k]));
+}
+
+static double point_rect_distance(double px, double py, const double r[4])
+{
+	double dx = px < r[0] ? r[0] - px : (px > r[2] ? px - r[2] : 0.0);
+	double dy = py < r[1] ? r[1] - py : (py > r[3] ? py - r[3] : 0.0);
+
+	return sqrt(dx * dx + dy * dy);
+}
+
+/* Does segment k pass through rectangle r (xlo, ylo, xhi, yhi)?  Liang-Barsky clipping. */
+static int segment_hits_rect(const struct segment_table *t, int k, const double r[4])
+{
+	double p[4], q[4], u0 = 0.0, u1 = 1.0, u;
+	int i;
+
+	p[0] = -t->dx[k];
+	q[0] = t->x1[k] - r[0];
+	p[1] = t->dx[k];
+	q[1] = r[2] - t->x1[k];
+	p[2] = -t->dy[k];
+	q[2] = t->y1[k] - r[1];
+	p[3] = t->dy[k];
+	q[3] = r[3] - t->y1[k];
+	for (i = 0; i < 4; i++) {
+		if (p[i] == 0.0) {
+			if (q[i] < 0.0)
+				return 0;
+			continue;
+		}
+		u = q[i] / p[i];
+		if (p[i] < 0.0) {
+			if (u > u1)
+				return 0;
+			if (u > u0)
+				u0 = u;
+		} else {
+			if (u < u0)
+				return 0;
+			if (u < u1)
+				u1 = u;
+		}
+	}
+	return 1;
+}
+
+static double segment_rect_min_distance(const struct segment_table *t, int k, const double r[4])
+{
+	double d, best;
+
+	if (segment_hits_rect(t, k, r))
+		return 0.0;
+	/* Otherwise the closest approach is at an end of the segment or a corner of the rectangle */
+	best = point_rect_distance(t->x1[k], t->y1[k], r);
+	d = point_rect_distance(t->x2[k], t->y2[k], r);
+	best = d < best ? d : best;
+	d = point_segment_distance(t, k, r[0], r[1]);
+	best = d < best ? d : best;
+	d = point_segment_distance(t, k, r[2], r[1]);
+	best = d < best ? d : best;
+	d = point_segment_distance(t, k, r[0], r[3]);
+	best = d < best ? d : best;
+	d = point_segment_distance(t, k, r[2], r[3]);
+	return d < best ? d : best;
+}
+
+static double segment_rect_max_distance(const struct segment_table *t, int k, const double r[4])
+{
+	double d, worst;
+
+	worst = point_segment_distance(t, k, r[0], r[1]);
+	d = point_segment_distance(t, k, r[2], r[1]);
+	worst = d > worst ? d : worst;
+	d = point_segment_distance(t, k, r[0], r[3]);
+	worst = d > worst ? d : worst;
+	d = point_segment_distance(t, k, r[2], r[3]);
+	return d > worst ? d : worst;
+}
+
+static void cull_cell(struct candidates *cand, int ngx, int ngy)
+{
+	struct grid *grid = cand->grid;
+	const struct segment_table *t = &grid->seg;
+	double r[4], dmin[MAX_NEIGHBORS], dmax, bound, slack;
+	int i, k, n, base, ystart, yend, xstart, xend;
+	int cell = ngy * grid->dim + ngx;
+
+	/* cells with no pixels (grid finer than the image) are never looked at */
+	ystart = cell_start(grid, cand->dim, ngy);
+	yend = cell_start(grid, cand->dim, ngy + 1);
+	if (yend > cand->dim)
+		yend = cand->dim;
+	xstart = cell_start(grid, cand->dim, ngx);
+	xend = cell_start(grid, cand->dim, ngx + 1);
+	if (xend > cand->dim)
+		xend = cand->dim;
+	if (xstart >= xend || ystart >= yend) {
+		cand->count[cell] = 0;
+		return;
+	}
+	r[0] = cand->coord[xstart];
+	r[1] = cand->coord[ystart];
+	r[2] = cand->coord[xend - 1];
+	r[3] = cand->coord[yend - 1];
+	base = segment_index(grid, ngx, ngy);
+	bound = 1e300;
+	for (i = 0; i < cand->nneighbors; i++) {
+		k = base + cand->offset[i];
+		dmin[i] = segment_rect_min_distance(t, k, r);
+		dmax = segment_rect_max_distance(t, k, r);
+		if (dmax < bound)
+			bound = dmax;
+	}
+	/* a little slack so rounding in the bounds can only ever keep extra segments */
+	slack = 1e-9 * (1.0 + bound);
+	n = 0;
+	for (i = 0; i < cand->nneighbors; i++)
+		if (dmin[i] <= bound + slack)
+			cand->which[cell * cand->nneighbors + n++] = (uint8_t) i;
+	cand->count[cell] = (uint8_t) n;
+}
+
+static void cull_cell_row(void *arg, int ngy, __attribute__((unused)) int worker)
+{
+	struct candidates *cand = arg;
+	int ngx;
+
+	for (ngx = 0; ngx < cand->grid->dim; ngx++)
+		cull_cell(cand, ngx, ngy);
+}
+
+static void cull_listed_cell(void *arg, int i, __attribute__((unused)) int worker)
+{
+	struct candidates *cand = arg;
+
+	cull_cell(cand, cand->cells[i] % cand->grid->dim, cand->cells[i] / cand->grid->dim);
+}
+
+/* Find the candidates for every cell, or if cells is not NULL, just the ncells cells listed */
+static void find_candidates(struct thread_pool *pool, struct candidates *cand, struct grid *grid, int dim,
+				int r, const double *coord, const int *cells, int ncells)
+{
+	int x, y;
+	size_t ngridcells = (size_t) grid->dim * grid->dim;
+
+	cand->nneighbors = 0;
+	for (y = -r; y <= r; y++)
+		for (x = -r; x <= r; x++)
+			cand->offset[cand->nneighbors++] = y * grid->seg.stride + x;
+	cand->count = malloc(ngridcells);
+	cand->which = malloc(ngridcells * cand->nneighbors);
+	cand->grid = grid;
+	cand->coord = coord;
+	cand->dim = dim;
+	cand->cells = cells;
+	if (cells)
+		thread_pool_run(pool, ncells, cull_listed_cell, cand);
+	else
+		thread_pool_run(pool, grid->dim, cull_cell_row, cand);
+}
+
+static void free_candidates(struct candidates *cand)
+{
+	free(cand->count);
+	free(cand->which);
+}
+
+/* Gather the candidate segments for pixels in grid cell (ngx, ngy) */
+static void cell_segments(struct erosion_job *job, int ngx, int ngy, struct erosion_segments *s)
+{
+	const struct candidates *cand = job->cand;
+	const struct segment_table *t = &job->grid->seg;
+	int i, k, base = segment_index(job->grid, ngx, ngy);
+	int cell = ngy * job->grid->dim + ngx;
+	const uint8_t *which = &cand->which[cell * cand->nneighbors];
+
+	s->n = cand->count[cell];
+	for (i = 0; i < s->n; i++) {
+		k = base + cand->offset[which[i]];
+		s->x1[i] = t->x1[k];
+		s->y1[i] = t->y1[k];
+		s->dx[i] = t->dx[k];
+		s->dy[i] = t->dy[k];
+		s->inv_len2[i] = t->inv_len2[k];
+	}
+}
+
+/* Set up c for combining the span of pixels starting at k of images whose rows are stride apart */
+static void combine_args_at(struct combine_args *c, height_t *acc, const height_t *prev,
+				const height_t *const *layer, const struct combine_program *prog, int k)
+{
+	int j;
+
+	c->acc = &acc[k];
+	c->prev = &prev[k];
+	for (j = 0; j < MAX_ITERATIONS; j++)
+		c->layer[j] = prog->layers & (1U << j) ? &layer[j][k] : NULL;
+}
+
+/* Store the heights h[0..n-1] of pixels (xmin..xmin + n - 1, y) */
+static void store_heights(struct erosion_job *job, const double *h, int y, int xmin, int n)
+{
+	const struct combine_step *c = job->combine;
+	struct combine_args args;
+	height_t stored[COMBINE_BLOCK];
+	int i, j, m, k = y * job->stride + xmin;
+
+	if (job->image)
+		for (i = 0; i < n; i++)
+			job->image[k + i] = h[i];
+	if (job->heights)
+		memcpy(&job->heights[y * job->dim + xmin], h, sizeof(*h) * n);
+	if (!c)
+		return;
+	/* combined from the heights as stored, to match combining whole layers exactly */
+	if (job->image || !c->prog->uses_height) {
+		combine_args_at(&args, c->acc, c->prev, c->layer, c->prog, k);
+		args.h = job->image ? &job->image[k] : NULL;
+		combine_span(c->prog, &args, n);
+		return;
+	}
+	for (i = 0; i < n; i += COMBINE_BLOCK) {
+		m = n - i < COMBINE_BLOCK ? n - i : COMBINE_BLOCK;
+		for (j = 0; j < m; j++)
+			stored[j] = h[i + j];
+		combine_args_at(&args, c->acc, c->prev, c->layer, c->prog, k + i);
+		args.h = stored;
+		combine_span(c->prog, &args, m);
+	}
+}
+
+/* The height of pixel (x, y), straight from the formulas in the README */
+static double reference_height(struct grid *grid, int dim, float feature_size, int r, int x, int y)
+{
+	int i, j, gx, gy, cx, cy, ngx, ngy;
+	double f1, f2, x1, y1, x2, y2, px, py, h;
+	double minh = 10000.0;
+
+	ngx = grid->dim * x / dim;
+	ngy = grid->dim * y / dim;
+	px = (double) x / feature_size;
+	py = (double) y / feature_size;
+	for (i = -r; i <= r; i++) {
+		for (j = -r; j <= r; j++) { /* Moore neighborhood, for r == 1 */
+			gx = ngx + j;
+			gy = ngy + i;
+			if (gx < 0 || gy < 0 || gx > grid->dim || gy > grid->dim)
+				continue;
+			x1 = gridpoint(grid, gx, gy)->x;
+			y1 = gridpoint(grid, gx, gy)->y;
+			cx = gridpoint(grid, gx, gy)->cx;
+			cy = gridpoint(grid, gx, gy)->cy;
+			x2 = gridpoint(grid, cx, cy)->x;
+			y2 = gridpoint(grid, cx, cy)->y;
+			f1 = ((y1 - y2) * (py - y1) + (x1 - x2) * (px - x1)) / (sqr(y1 - y2) + sqr(x1 - x2));
+			if (f1 > 0.0) {
+				h = sqrt(sqr(px - x1) + sqr(py - y1));
+			} else if (f1 < -1.0) {
+				h = sqrt(sqr(px - x2) + sqr(py - y2));
+			} else {
+				f2 = fabs(((y1 - y2) * (px - x1) - (x1 - x2) * (py - y1)) /
+						sqrt(sqr(x1 - x2) + sqr(y1 - y2)));
+				h = f2;
+			}
+			if (h < minh)
+				minh = h;
+		}
+	}
+	return minh;
+}
+
+/* The heights of the pixels of rectangle (xmin, ymin) - (xmax, ymax), at most
+ * TILE_SIZE on a side, into h, rows TILE_SIZE apart.  With a block kernel,
+ * each block of pixels sharing a grid cell goes to the kernel in one call.
+ */
+static void rect_heights(struct erosion_job *job, int xmin, int ymin, int xmax, int ymax, double *h)
+{
+	struct grid *grid = job->grid;
+	int dim = job->dim;
+	int x, y, xend, yend, ngx, ngy;
+	struct erosion_segments s;
+
+	if (!job->kernel) {
+		for (y = ymin; y < ymax; y++)
+			for (x = xmin; x < xmax; x++) /* For each pixel... */
+				h[(y - ymin) * TILE_SIZE + x - xmin] = reference_height(grid, dim,
+							job->feature_size, job->run->p->neighborhood_radius, x, y);
+		return;
+	}
+	for (y = ymin; y < ymax; y = yend) {
+		ngy = grid->dim * y / dim;
+		yend = cell_start(grid, dim, ngy + 1);
+		if (yend > ymax)
+			yend = ymax;
+		for (x = xmin; x < xmax; x = xend) {
+			ngx = grid->dim * x / dim;
+			xend = cell_start(grid, dim, ngx + 1);
+			if (xend > xmax)
+				xend = xmax;
+			cell_segments(job, ngx, ngy, &s);
+			job->kernel(&s, &job->coord[x], xend - x, &job->coord[y], yend - y,
+					&h[(y - ymin) * TILE_SIZE + x - xmin], TILE_SIZE);
+		}
+	}
+}
+
+static void erode_tile(void *arg, int tile, __attribute__((unused)) int worker)
+{
+	struct erosion_job *job = arg;
+	int dim = job->dim;
+	int y, xmin, ymin, xmax, ymax;
+	double h[TILE_SIZE * TILE_SIZE];
+
+	xmin = (tile % job->tiles_across) * TILE_SIZE;
+	ymin = (tile / job->tiles_across) * TILE_SIZE;
+	xmax = xmin + TILE_SIZE > dim ? dim : xmin + TILE_SIZE;
+	ymax = ymin + TILE_SIZE > dim ? dim : ymin + TILE_SIZE;
+
+	rect_heights(job, xmin, ymin, xmax, ymax, h);
+	for (y = ymin; y < ymax; y++)
+		store_heights(job, &h[(y - ymin) * TILE_SIZE], y, xmin, xmax - xmin);
+	erosion_progress(job);
+}
+
+/*
+ * Cell traversal: each task is one block of the pixels covered by a single
+ * grid cell.  Cells bigger than TILE_SIZE pixels on a side are split into
+ * blocks_per_cell x blocks_per_cell blocks so there is enough work to go
+ * around on the coarse iterations.  The nine segments are gathered once
+ * per block and the kernel keeps them in registers for the whole block;
+ * there is no per pixel cell lookup at all.
+ */
+static void block_range(struct erosion_job *job, int b, int *start, int *end)
+{
+	int bpc = job->blocks_per_cell;
+	int c = b / bpc, part = b % bpc;
+	int cstart = cell_start(job->grid, job->dim, c);
+	int cend = cell_start(job->grid, job->dim, c + 1);
+
+	if (cend > job->dim)
+		cend = job->dim;
+	*start = cstart + (cend - cstart) * part / bpc;
+	*end = cstart + (cend - cstart) * (part + 1) / bpc;
+}
+
+static void erode_cell_block(void *arg, int task, __attribute__((unused)) int worker)
+{
+	struct erosion_job *job = arg;
+	int bpc = job->blocks_per_cell, blocks_across = job->grid->dim * bpc;
+	int bx = task % blocks_across, by = task / blocks_across;
+	int x, y, xmin, xmax, ymin, ymax, w, c, part;
+	double h[TILE_SIZE * TILE_SIZE];
+	struct erosion_segments s;
+
+	if (job->cells) {
+		c = job->cells[task / (bpc * bpc)];
+		part = task % (bpc * bpc);
+		bx = (c % job->grid->dim) * bpc + part % bpc;
+		by = (c / job->grid->dim) * bpc + part / bpc;
+	}
+	block_range(job, bx, &xmin, &xmax);
+	block_range(job, by, &ymin, &ymax);
+	w = xmax - xmin;
+	if (!job->kernel) {
+		for (y = ymin; y < ymax; y++)
+			for (x = xmin; x < xmax; x++)
+				h[(y - ymin) * w + x - xmin] =
+					reference_height(job->grid, job->dim, job->feature_size,
+							job->run->p->neighborhood_radius, x, y);
+	} else if (w > 0 && ymax > ymin) {
+		cell_segments(job, bx / job->blocks_per_cell, by / job->blocks_per_cell, &s);
+		job->kernel(&s, &job->coord[xmin], w, &job->coord[ymin], ymax - ymin, h, w);
+	}
+	for (y = ymin; y < ymax && w > 0; y++)
+		store_heights(job, &h[(y - ymin) * w], y, xmin, w);
+	erosion_progress(job);
+}
+
+struct error_report_job {
+	struct erosion_job *ejob;
+	double *max_error; /* per row */
+	int *ndiffer; /* per row */
+};
+
+static void error_report_row(void *arg, int y, __attribute__((unused)) int worker)
+{
+	struct error_report_job *rj = arg;
+	struct erosion_job *job = rj->ejob;
+	double h, err, max_error = 0.0;
+	int x, ndiffer = 0;
+
+	for (x = 0; x < job->dim; x++) {
+		h = reference_height(job->grid, job->dim, job->feature_size,
+					job->run->p->neighborhood_radius, x, y);
+		err = fabs(h - job->heights[y * job->dim + x]);
+		if (err > max_error)
+			max_error = err;
+		if ((height_t) h != (height_t) job->heights[y * job->dim + x])
+			ndiffer++;
+	}
+	rj->max_error[y] = max_error;
+	rj->ndiffer[y] = ndiffer;
+}
+
+static double average_candidates(struct erosion_job *job)
+{
+	int64_t total = 0, ncells = 0;
+	int x, y;
+
+	for (y = 0; y < job->grid->dim; y++) {
+		if (cell_start(job->grid, job->dim, y) >= cell_start(job->grid, job->dim, y + 1))
+			continue;
+		for (x = 0; x < job->grid->dim; x++) {
+			if (cell_start(job->grid, job->dim, x) >= cell_start(job->grid, job->dim, x + 1))
+				continue;
+			total += job->cand->count[y * job->grid->dim + x];
+			ncells++;
+		}
+	}
+	return ncells ? (double) total / ncells : 0.0;
+}
+
+/* Compare what the kernel produced against the reference code, for -E */
+static void error_report(struct erosion_job *job)
+{
+	struct error_report_job rj;
+	double max_error = 0.0;
+	int64_t ndiffer = 0;
+	int y;
+
+	rj.ejob = job;
+	rj.max_error = malloc(sizeof(*rj.max_error) * job->dim);
+	rj.ndiffer = malloc(sizeof(*rj.ndiffer) * job->dim);
+	thread_pool_run(job->pool, job->dim, error_report_row, &rj);
+	for (y = 0; y < job->dim; y++) {
+		if (rj.max_error[y] > max_error)
+			max_error = rj.max_error[y];
+		ndiffer += rj.ndiffer[y];
+	}
+	printf("pseudo-erosion: %s vs. reference: max error %g, %lld of %lld pixels differ\n",
+		job->name, max_error, (long long) ndiffer, (long long) job->dim * job->dim);
+	if (job->cand)
+		printf("pseudo-erosion: %.2f of %d candidate segments per cell after culling\n",
+			average_candidates(job), job->cand->nneighbors);
+	free(rj.max_error);
+	free(rj.ndiffer);
+}
+
+struct heights_job {
+	struct erosion_job *ejob;
+	const double *h;
+};
+
+static void store_heights_row(void *arg, int y, __attribute__((unused)) int worker)
+{
+	struct heights_job *hj = arg;
+
+	store_heights(hj->ejob, &hj->h[y * hj->ejob->dim], y, 0, hj->ejob->dim);
+}
+
+/* pseudo_erosion() by way of a whole image distance transform, see distance_field.h */
+static void distance_field_erosion(struct erosion_job *job)
+{
+	struct segment_table *t = &job->grid->seg;
+	struct distance_field_segments s;
+	struct heights_job hj;
+	double *h;
+
+	s.n = t->stride * t->stride;
+	s.x1 = t->x1;
+	s.y1 = t->y1;
+	s.dx = t->dx;
+	s.dy = t->dy;
+	s.inv_len2 = t->inv_len2;
+	hj.ejob = job;
+	hj.h = h = malloc(sizeof(*h) * job->dim * job->dim);
+	distance_field(job->pool, job->run->p->engine == PSEUDO_EROSION_EDT ? DISTANCE_FIELD_EDT : DISTANCE_FIELD_JFA,
+			&s, job->dim, job->feature_size, h);
+	job->heights = NULL;
+	thread_pool_run(job->pool, job->dim, store_heights_row, &hj);
+	job->heights = h;
+	if (job->run->p->error_report)
+		error_report(job);
+	free(h);
+}
+
+/* Set up job for computing image (rows stride apart) from grid with the
+ * pixel engine, see erode_layer()
+ */
+static void start_erosion(struct erosion_job *job, const struct run *r, height_t *image, int stride,
+				struct grid *grid, float feature_size, const int *cells, int ncells,
+				const struct combine_step *combine)
+{
+	int x, dim = r->p->size;
+
+	job->run = r;
+	job->pool = r->pool;
+	job->image = image;
+	job->stride = stride;
+	job->grid = grid;
+	job->dim = dim;
+	job->feature_size = feature_size;
+	job->cand = NULL;
+	job->cells = cells;
+	job->combine = combine;
+	job->quiet = 0;
+	job->name = r->kernel_name;
+	job->kernel = r->kernel;
+	job->coord = NULL;
+	if (job->kernel) {
+		job->coord = malloc(sizeof(*job->coord) * dim);
+		for (x = 0; x < dim; x++)
+			job->coord[x] = (double) x / feature_size;
+		job->cand = malloc(sizeof(*job->cand));
+		find_candidates(r->pool, job->cand, grid, dim, r->p->neighborhood_radius, job->coord, cells, ncells);
+	}
+	job->heights = NULL;
+	if (job->kernel && r->p->error_report && !cells)
+		job->heights = malloc(sizeof(*job->heights) * dim * dim);
+	atomic_init(&job->tasks_done, 0);
+	atomic_init(&job->dots_printed, 0);
+}
+
+static void finish_erosion(struct erosion_job *job)
+{
+	if (job->run->p->verbose && !job->quiet)
+		printf("\n");
+	if (job->heights) {
+		error_report(job);
+		free(job->heights);
+	}
+	if (job->cand) {
+		free_candidates(job->cand);
+		free(job->cand);
+	}
+	free(job->coord);
+	fflush(stdout);
+}
+
+/* Compute image (rows stride apart) from grid.  If cells is not NULL, only
+ * the pixels of the ncells grid cells listed are computed, the rest of
+ * image is left alone.  If combine is not NULL, each pixel is also combined
+ * as it is computed, and image may be NULL if the layer itself isn't wanted.
+ */
+static void erode_layer(const struct run *r, height_t *image, int stride, struct grid *grid, float feature_size,
+				const int *cells, int ncells, const struct combine_step *combine)
+{
+	struct erosion_job job;
+	int dim = r->p->size;
+
+	if (r->p->engine != PSEUDO_EROSION_PIXEL) { /* always the whole image */
+		memset(&job, 0, sizeof(job));
+		job.run = r;
+		job.pool = r->pool;
+		job.image = image;
+		job.stride = stride;
+		job.grid = grid;
+		job.dim = dim;
+		job.feature_size = feature_size;
+		job.combine = combine;
+		job.name = r->p->engine == PSEUDO_EROSION_EDT ? "edt" : "jfa";
+		distance_field_erosion(&job);
+		if (r->p->verbose)
+			printf("\n");
+		fflush(stdout);
+		return;
+	}
+	start_erosion(&job, r, image, stride, grid, feature_size, cells, ncells, combine);
+
+	/* Every pixel is computed independently by the same code, so the
+	 * output does not depend on the number of threads or the traversal.
+	 */
+	if ((job.kernel && !r->p->tile_traversal) || cells) {
+		int max_cell = (dim + grid->dim - 1) / grid->dim;
+
+		job.blocks_per_cell = (max_cell + TILE_SIZE - 1) / TILE_SIZE;
+		if (cells)
+			job.ntasks = ncells * job.blocks_per_cell * job.blocks_per_cell;
+		else
+			job.ntasks = grid->dim * job.blocks_per_cell * grid->dim * job.blocks_per_cell;
+		thread_pool_run(r->pool, job.ntasks, erode_cell_block, &job);
+	} else {
+		job.tiles_across = (dim + TILE_SIZE - 1) / TILE_SIZE;
+		job.ntasks = job.tiles_across * job.tiles_across;
+		thread_pool_run(r->pool, job.ntasks, erode_tile, &job);
+	}
+	finish_erosion(&job);
+}
+
+/* Combine iteration i's layer into image, within rectangle r (xmin, ymin, xmax, ymax) */
+static void combine_rect(const struct combine_program *prog, height_t *image, const height_t *const *layer,
+				int i, int stride, const int r[4])
+{
+	struct combine_args c;
+	int y;
+
+	for (y = r[1]; y < r[3]; y++) {
+		combine_args_at(&c, image, image, layer, prog, y * stride + r[0]);
+		c.h = prog->uses_height ? &layer[i][y * stride + r[0]] : NULL;
+		combine_span(prog, &c, r[2] - r[0]);
+	}
+}
+
+static int iteration_feature_size(const struct pseudo_erosion_params *p, int i)
+{
+	return p->feature_size / pipeline(p)->iteration[i].feature_div;
+}
+
+static int iteration_grid_dim(const struct pseudo_erosion_params *p, int i)
+{
+	return p->grid_size * pipeline(p)->iteration[i].grid_scale;
+}
+
+/*
+ * How a pipeline runs with particular parameters.  Iterations whose
+ * features would be less than a pixel across are skipped, and so are those
+ * needing a skipped iteration's layer.  A layer that nothing uses (no
+ * combine expression, no iteration_done(), no terrain keeping the stages)
+ * is not computed, and if that leaves an iteration nothing to do, it is
+ * skipped too.  Where there is a layer to compute and a combine step, the
+ * two are fused, see struct combine_step.  With written_late set,
+ * iteration_done() may still be writing out one iteration's images while
+ * the next is being computed, see terrain_generate().
+ */
+struct iteration_plan {
+	int grid_dim; /* grid cells across */
+	int feature_size;
+	int heights_from_image;
+	struct combine_program combine;
+	const char *skipped; /* why, or NULL if it isn't */
+	int erode; /* the layer is computed */
+	int combines; /* has a combine step: not the first iteration, and the expression isn't just a */
+	int own_image; /* the combined image gets its own buffer instead of updating the last one in place */
+	int layer_last_use; /* the last iteration whose combine expression uses the layer, or -1 */
+	uint64_t layer_key, acc_key; /* with a stage cache, see plan_cache() */
+	FILE *cached_layer, *cached_acc; /* read these from the cache instead of computing them */
+};
+
+struct pipeline_plan {
+	int niterations;
+	struct iteration_plan it[MAX_ITERATIONS];
+};
+
+/* The first layer is the image to start with, so if a later expression
+ * uses it, the first combine step must leave it alone.  Nor can one that
+ * is still being written out be combined into in place.
+ */
+static void plan_own_images(struct pipeline_plan *pp, int keep_stages, int written_late)
+{
+	int i;
+
+	for (i = 0; i < pp->niterations; i++)
+		pp->it[i].own_image = 0;
+	for (i = 1; i < pp->niterations; i++) {
+		if (!pp->it[i].combines)
+			continue;
+		if (keep_stages || written_late) {
+			pp->it[i].own_image = 1;
+		} else if (pp->it[0].layer_last_use >= 0) {
+			pp->it[i].own_image = 1;
+			break;
+		}
+	}
+}
+
+static void plan_pipeline(struct pipeline_plan *pp, const struct pseudo_erosion_params *p,
+				int keep_stages, int write_images, int written_late)
+{
+	const struct pseudo_erosion_pipeline *pl = pipeline(p);
+	struct iteration_plan *ip;
+	int i, j;
+
+	pp->niterations = pl->niterations;
+	for (i = 0; i < pp->niterations; i++) {
+		ip = &pp->it[i];
+		memset(ip, 0, sizeof(*ip));
+		ip->grid_dim = iteration_grid_dim(p, i);
+		ip->feature_size = iteration_feature_size(p, i);
+		ip->heights_from_image = pl->iteration[i].heights_from_image;
+		ip->layer_last_use = -1;
+		if (i > 0)
+			combine_compile(pl->iteration[i].combine, i, &ip->combine, NULL, 0);
+		if (ip->feature_size < 1)
+			ip->skipped = "its features would be less than a pixel across";
+		for (j = 0; j < i; j++)
+			if ((ip->combine.layers & (1U << j)) && pp->it[j].skipped)
+				ip->skipped = "it needs a skipped iteration's layer";
+		if (ip->skipped)
+			continue;
+		for (j = 0; j < i; j++)
+			if (ip->combine.layers & (1U << j))
+				pp->it[j].layer_last_use = i;
+	}
+
+	pp->it[0].erode = !p->input;
+	for (i = 1; i < pp->niterations; i++) {
+		ip = &pp->it[i];
+		if (ip->skipped)
+			continue;
+		ip->combines = !combine_is_just_the_image(&ip->combine);
+		ip->erode = ip->combine.uses_height || ip->layer_last_use >= 0 || keep_stages || write_images;
+		if (!ip->erode && !ip->combines)
+			ip->skipped = "nothing uses it";
+	}
+
+	plan_own_images(pp, keep_stages, written_late);
+}
+
+/*
+ * Everything the iterations produce.  layer[i] is what erode_layer() made
+ * for iteration i, and acc[i] is the combined image after iteration i,
+ * acc[0] being layer[0].  Normally the combined images are all one buffer,
+ * combined in place, but terrain_update() needs each stage kept to
+ * recombine just the dirty parts, so with keep_stages set each gets its own
+ * buffer, and the grids are kept too.  Skipped iterations have no grid or
+ * layer, and their acc[i] is acc[i - 1].  The buffers live in arena, laid
+ * out by plan_buffers(), and are NULL outside their lifetimes.  All of
+ * them have their rows stride apart.
+ */
+struct terrain {
+	const struct run *r; /* of the call in progress */
+	int dim, stride;
+	int keep_stages;
+	struct pipeline_plan plan;
+	struct grid *grid[MAX_ITERATIONS];
+	height_t *layer[MAX_ITERATIONS];
+	height_t *acc[MAX_ITERATIONS];
+	const struct pseudo_erosion_edit *edit; /* applied whenever a grid is set up */
+	int nedits;
+	struct arena *arena; /* created by terrain_generate() if NULL, else reused */
+	struct stage_cache *cache; /* NULL if not caching stages */
+	atomic_int stop; /* 0, or why the task graph stopped: PSEUDO_EROSION_CANCELLED or _CACHE_ERROR */
+};
+
+/*
+ * Buffer lifetimes.  Each heightfield is live from the iteration that
+ * writes it through the last one that reads it or writes it out (or for
+ * good, BUFFER_FOREVER, with keep_stages).  Two whose lifetimes don't
+ * overlap can share memory, so plan_buffers() packs them into as few
+ * image sized slots as it can: taking them in order of first use and
+ * reusing any slot whose owner is already dead, which is optimal for
+ * intervals.  For the built in pipeline that is the combined image plus
+ * img3 and img4, which f3 and f4 still need, plus one more for whichever
+ * layer is being written out.  With written_late, whatever an iteration
+ * writes out lives on through the next iteration.
+ */
+#define BUFFER_FOREVER MAX_ITERATIONS
+#define NBUFFERS (2 * MAX_ITERATIONS) /* acc[i] is buffer i, layer[i] is MAX_ITERATIONS + i */
+
+struct buffer_plan {
+	int first[NBUFFERS], last[NBUFFERS]; /* first == -1 if not needed at all */
+	int slot[NBUFFERS];
+	int nslots;
+	int final; /* the buffer the finished image ends up in */
+};
+
+static void plan_buffers(struct buffer_plan *bp, const struct pipeline_plan *pp, int keep_stages,
+				int write_images, int written_late)
+{
+	const struct iteration_plan *ip;
+	int slot_free_after[NBUFFERS];
+	int n = pp->niterations, i, b, it, s, next;
+
+	for (b = 0; b < NBUFFERS; b++)
+		bp->first[b] = -1;
+	/* acc[0] is layer[0].  A combined image with a buffer of its own is
+	 * updated in place by the iterations after it, up to the next one.
+	 */
+	for (i = 0; i < n; i++) {
+		if (i > 0 && !pp->it[i].own_image)
+			continue;
+		for (next = i + 1; next < n && !pp->it[next].own_image; next++)
+			;
+		bp->first[i] = i;
+		bp->last[i] = next < n ? next : n - 1;
+		if (i == 0 && pp->it[0].layer_last_use > bp->last[0])
+			bp->last[0] = pp->it[0].layer_last_use;
+		if (keep_stages)
+			bp->last[i] = BUFFER_FOREVER;
+		bp->final = i;
+	}
+	for (i = 1; i < n; i++) {
+		ip = &pp->it[i];
+		b = MAX_ITERATIONS + i;
+		if (!(ip->erode || ip->cached_layer) || !(keep_stages || write_images || ip->layer_last_use >= 0))
+			continue;
+		bp->first[b] = i;
+		if (keep_stages)
+			bp->last[b] = BUFFER_FOREVER;
+		else
+			bp->last[b] = ip->layer_last_use > i ? ip->layer_last_use : i;
+		if (written_late && bp->last[b] == i && i + 1 < n)
+			bp->last[b] = i + 1;
+	}
+
+	bp->nslots = 0;
+	for (it = 0; it < n; it++) {
+		for (b = 0; b < NBUFFERS; b++) {
+			if (bp->first[b] != it)
+				continue;
+			for (s = 0; s < bp->nslots; s++)
+				if (slot_free_after[s] < it)
+					break;
+			if (s == bp->nslots)
+				bp->nslots++;
+			bp->slot[b] = s;
+			slot_free_after[s] = bp->last[b];
+		}
+	}
+}
+
+/*
+ * Stage keys.  Everything a layer or combined image depends on goes into
+ * its key, with the keys of the stages it is made from standing in for
+ * those stages, so a key changes whenever the stage would come out any
+ * different.  The exact kernels all give the same results, so they share
+ * keys, and the reference code and the scanline kernel get their own.
+ */
+static uint64_t hash_value(uint64_t h, uint64_t v)
+{
+	return stage_hash(h, &v, sizeof(v));
+}
+
+static uint64_t hash_string(uint64_t h, const char *s)
+{
+	return stage_hash(h, s, strlen(s) + 1);
+}
+
+/* What every stage depends on */
+static uint64_t base_key(const struct terrain *t)
+{
+	const struct run *r = t->r;
+	const struct pseudo_erosion_params *p = r->p;
+	uint64_t h = hash_string(STAGE_HASH_INIT, "pseudo-erosion stage 1");
+
+	h = hash_value(h, sizeof(height_t));
+	h = hash_value(h, t->dim);
+	h = hash_value(h, p->seed);
+	h = hash_value(h, p->neighborhood_radius);
+	h = hash_value(h, p->engine);
+	if (p->noise_lattice)
+		h = hash_value(h, p->noise_lattice);
+	if (p->engine == PSEUDO_EROSION_PIXEL)
+		h = hash_string(h, !r->kernel ? "reference" :
+				strcmp(r->kernel_name, "scanline") == 0 ? "scanline" : "exact");
+	return h;
+}
+
+static uint64_t input_key(const struct terrain *t, uint64_t base)
+{
+	const struct pseudo_erosion_params *p = t->r->p;
+	uint64_t h = hash_string(base, "input");
+	int y;
+
+	for (y = 0; y < t->dim; y++)
+		h = stage_hash(h, &p->input[(size_t) y * p->input_stride], sizeof(*p->input) * t->dim);
+	return h;
+}
+
+static uint64_t layer_key(const struct pipeline_plan *pp, int i, uint64_t base)
+{
+	const struct iteration_plan *ip = &pp->it[i];
+	uint64_t h = hash_string(base, "layer");
+
+	h = hash_value(h, ip->grid_dim);
+	h = hash_value(h, ip->feature_size);
+	h = hash_value(h, ip->heights_from_image);
+	if (ip->heights_from_image)
+		h = hash_value(h, pp->it[i - 1].acc_key);
+	return h;
+}
+
+static uint64_t acc_key(const struct pipeline_plan *pp, int i, uint64_t base)
+{
+	const struct iteration_plan *ip = &pp->it[i];
+	const struct combine_program *prog = &ip->combine;
+	uint64_t h = hash_string(base, "combine");
+	int k;
+
+	for (k = 0; k < prog->nops; k++) {
+		h = hash_value(h, prog->op[k].op);
+		h = hash_value(h, prog->op[k].layer);
+		h = stage_hash(h, &prog->op[k].value, sizeof(prog->op[k].value));
+	}
+	h = hash_value(h, pp->it[i - 1].acc_key);
+	if (prog->uses_height)
+		h = hash_value(h, ip->layer_key);
+	for (k = 0; k < i; k++)
+		if (prog->layers & (1U << k))
+			h = hash_value(h, pp->it[k].layer_key);
+	return h;
+}
+
+/*
+ * Cut the plan down to what the output needs, given what is in the cache.
+ * Going back from the last iteration: a wanted combined image is read from
+ * the cache if it is there, else it wants the image before it and the
+ * layers its expression uses.  A wanted layer likewise is read if it is
+ * there, else computed, wanting the image before it if its grid takes its
+ * heights from there.  Iterations nothing is wanted from are skipped.  With
+ * iteration_done(), everything is wanted.  plan_pipeline() must have been
+ * told to compute every layer, so that there is one to store.
+ */
+static void plan_cache(struct terrain *t, int written_late)
+{
+	const struct pseudo_erosion_params *p = t->r->p;
+	struct pipeline_plan *pp = &t->plan;
+	struct iteration_plan *ip;
+	uint64_t base = base_key(t);
+	int want_acc[MAX_ITERATIONS], want_layer[MAX_ITERATIONS];
+	int i, j, n = pp->niterations;
+
+	for (i = 0; i < n; i++) {
+		ip = &pp->it[i];
+		if (i == 0) {
+			ip->layer_key = ip->acc_key = p->input ? input_key(t, base) : layer_key(pp, 0, base);
+		} else if (ip->skipped) {
+			ip->acc_key = pp->it[i - 1].acc_key;
+		} else {
+			ip->layer_key = layer_key(pp, i, base);
+			ip->acc_key = ip->combines ? acc_key(pp, i, base) : pp->it[i - 1].acc_key;
+		}
+		want_acc[i] = want_layer[i] = p->iteration_done && !ip->skipped;
+	}
+
+	want_acc[n - 1] = 1;
+	for (i = n - 1; i >= 0; i--) {
+		ip = &pp->it[i];
+		if (i > 0 && (ip->skipped || !ip->combines)) { /* acc[i] is acc[i - 1] */
+			want_acc[i - 1] |= want_acc[i];
+		} else if (i > 0 && want_acc[i]) {
+			ip->cached_acc = stage_cache_find(t->cache, ip->acc_key, t->dim);
+			if (!ip->cached_acc) {
+				want_acc[i - 1] = 1;
+				want_layer[i] |= ip->combine.uses_height;
+				for (j = 0; j < i; j++)
+					if (ip->combine.layers & (1U << j))
+						want_layer[j] = 1;
+			}
+		} else if (i == 0) {
+			want_layer[0] |= want_acc[0];
+		}
+		if (ip->skipped)
+			continue;
+		if (want_layer[i] && ip->erode) {
+			ip->cached_layer = stage_cache_find(t->cache, ip->layer_key, t->dim);
+			if (!ip->cached_layer && ip->heights_from_image)
+				want_acc[i - 1] = 1;
+		}
+		ip->erode = ip->erode && want_layer[i] && !ip->cached_layer;
+		if (!want_acc[i])
+			ip->combines = 0;
+		if (!want_layer[i] && !want_acc[i])
+			ip->skipped = "what comes after it is cached";
+		else if (i > 0 && !ip->erode && !ip->cached_layer && !ip->combines)
+			ip->skipped = "nothing uses it";
+	}
+	plan_own_images(pp, 0, written_late);
+}
+
+static void close_cached_stages(struct pipeline_plan *pp)
+{
+	int i;
+
+	for (i = 0; i < pp->niterations; i++) {
+		if (pp->it[i].cached_layer)
+			fclose(pp->it[i].cached_layer);
+		if (pp->it[i].cached_acc)
+			fclose(pp->it[i].cached_acc);
+		pp->it[i].cached_layer = pp->it[i].cached_acc = NULL;
+	}
+}
+
+static void tile_rect(int dim, int tile, int r[4])
+{
+	int tiles_across = (dim + TILE_SIZE - 1) / TILE_SIZE;
+
+	r[0] = (tile % tiles_across) * TILE_SIZE;
+	r[1] = (tile / tiles_across) * TILE_SIZE;
+	r[2] = r[0] + TILE_SIZE > dim ? dim : r[0] + TILE_SIZE;
+	r[3] = r[1] + TILE_SIZE > dim ? dim : r[1] + TILE_SIZE;
+}
+
+struct combine_job {
+	struct terrain *t;
+	int iteration;
+	const int *tiles; /* if not NULL, only these tiles are combined */
+};
+
+static void combine_tile(void *arg, int task, __attribute__((unused)) int worker)
+{
+	struct combine_job *cj = arg;
+	struct terrain *t = cj->t;
+	int i = cj->iteration;
+	height_t *acc = t->acc[i], *prev = t->acc[i - 1];
+	int y, r[4];
+
+	tile_rect(t->dim, cj->tiles ? cj->tiles[task] : task, r);
+	if (acc != prev)
+		for (y = r[1]; y < r[3]; y++)
+			memcpy(&acc[y * t->stride + r[0]], &prev[y * t->stride + r[0]], sizeof(*acc) * (r[2] - r[0]));
+	combine_rect(&t->plan.it[i].combine, acc, (const height_t *const *) t->layer, i, t->stride, r);
+}
+
+/* Combine iteration i's layer into acc[i], all of it, or just the ntiles tiles listed */
+static void combine_iteration(struct terrain *t, int i, const int *tiles, int ntiles)
+{
+	struct combine_job cj;
+	int tiles_across = (t->dim + TILE_SIZE - 1) / TILE_SIZE;
+
+	cj.t = t;
+	cj.iteration = i;
+	cj.tiles = tiles;
+	thread_pool_run(t->r->pool, tiles ? ntiles : tiles_across * tiles_across, combine_tile, &cj);
+}
+
+/* Place the points of grid g for iteration i, on pool, and apply any edits for iteration i */
+static void place_iteration_grid(const struct run *r, struct thread_pool *pool, struct grid *g, int i,
+				const struct pseudo_erosion_edit *edit, int nedits)
+{
+	int fs = iteration_feature_size(r->p, i);
+	int k;
+
+	place_grid_points(pool, r->noise, g, r->p->size, fs);
+	for (k = 0; k < nedits; k++) {
+		if (edit[k].iteration != i)
+			continue;
+		gridpoint(g, edit[k].gx, edit[k].gy)->x = edit[k].x / fs;
+		gridpoint(g, edit[k].gx, edit[k].gy)->y = edit[k].y / fs;
+	}
+}
+
+/* Set up grid g for iteration i: place the points, apply any edits for
+ * iteration i, connect them, heights coming from image if not NULL
+ */
+static void setup_grid(const struct run *r, struct grid *g, int i, const struct pseudo_erosion_edit *edit,
+			int nedits, const height_t *image, int stride)
+{
+	place_iteration_grid(r, r->pool, g, i, edit, nedits);
+	connect_grid(r->pool, r->noise, g, r->p->size, image, stride);
+}
+
+/*
+ * terrain_generate() runs each iteration as a few tasks in a task graph:
+ *
+ *	place		allocate the grid and place its points, which only
+ *			takes the noise, so it can happen any time
+ *	connect		connect the points, after the image so far is done if
+ *			the heights come from it, and then on the pool since
+ *			the next iteration is waiting for it
+ *	iteration	erode the layer and combine it, or just combine, or
+ *			copy in the input image, on the pool
+ *	done		call iteration_done(), in order, one at a time
+ *
+ * so that grids are ready by the time the pool gets to them, and images
+ * get written out while the pool goes on with the next iteration.
+ */
+struct iteration_task {
+	struct terrain *t;
+	int i;
+};
+
+static void place_grid_task(void *arg)
+{
+	struct iteration_task *it = arg;
+	struct terrain *t = it->t;
+
+	if (atomic_load(&t->stop))
+		return;
+	t->grid[it->i] = allocate_grid(t->plan.it[it->i].grid_dim, t->r->p->neighborhood_radius);
+	place_iteration_grid(t->r, NULL, t->grid[it->i], it->i, t->edit, t->nedits);
+}
+
+static void connect_grid_task(void *arg)
+{
+	struct iteration_task *it = arg;
+	struct terrain *t = it->t;
+	struct grid *g = t->grid[it->i];
+
+	if (atomic_load(&t->stop))
+		return;
+	if (t->plan.it[it->i].heights_from_image)
+		connect_grid(t->r->pool, t->r->noise, g, t->dim, t->acc[it->i - 1], t->stride);
+	else
+		connect_grid(NULL, t->r->noise, g, t->dim, NULL, 0);
+}
+
+static void iteration_task(void *arg)
+{
+	struct iteration_task *it = arg;
+	struct terrain *t = it->t;
+	const struct pseudo_erosion_params *p = t->r->p;
+	const struct iteration_plan *ip = &t->plan.it[it->i];
+	struct combine_step c;
+	int i = it->i, y;
+
+	if (atomic_load(&t->stop))
+		return;
+	if (p->cancelled && p->cancelled(p->cancel_arg)) {
+		atomic_store(&t->stop, PSEUDO_EROSION_CANCELLED);
+		return;
+	}
+	if (ip->skipped) {
+		if (p->verbose)
+			printf("pseudo-erosion: skipping iteration %d, %s\n", i + 1, ip->skipped);
+		return;
+	}
+	if (ip->cached_layer || ip->cached_acc) {
+		if (p->verbose)
+			printf("pseudo-erosion: iteration %d: reading %s from the cache\n", i + 1,
+				!ip->cached_acc ? "the layer" : !ip->cached_layer ? "the combined image" :
+				"the layer and the combined image");
+		if ((ip->cached_layer && stage_cache_read(ip->cached_layer, t->layer[i], t->dim, t->stride)) ||
+			(ip->cached_acc && stage_cache_read(ip->cached_acc, t->acc[i], t->dim, t->stride))) {
+			atomic_store(&t->stop, PSEUDO_EROSION_CACHE_ERROR);
+			return;
+		}
+	}
+	if (i == 0 && p->input) {
+		for (y = 0; y < t->dim; y++)
+			memcpy(&t->layer[0][y * t->stride], &p->input[y * p->input_stride],
+				sizeof(*p->input) * t->dim);
+	} else if (ip->erode) {
+		c.prog = &ip->combine;
+		c.acc = t->acc[i];
+		c.prev = i > 0 ? t->acc[i - 1] : NULL;
+		c.layer = (const height_t *const *) t->layer;
+		erode_layer(t->r, t->layer[i], t->stride, t->grid[i], ip->feature_size, NULL, 0,
+				ip->combines && !ip->cached_acc ? &c : NULL);
+	} else if (ip->combines && !ip->cached_acc) {
+		combine_iteration(t, i, NULL, 0);
+	}
+	if (t->cache) { /* whatever was just computed */
+		if (ip->erode)
+			stage_cache_store(t->cache, ip->layer_key, t->layer[i], t->dim, t->stride);
+		if (ip->combines && !ip->cached_acc)
+			stage_cache_store(t->cache, ip->acc_key, t->acc[i], t->dim, t->stride);
+	}
+	if (t->grid[i] && !t->keep_stages) {
+		free_grid(t->grid[i]);
+		t->grid[i] = NULL;
+	}
+}
+
+static void iteration_done_task(void *arg)
+{
+	struct iteration_task *it = arg;
+	struct terrain *t = it->t;
+	const struct pseudo_erosion_params *p = t->r->p;
+
+	if (atomic_load(&t->stop))
+		return;
+	p->iteration_done(p->iteration_arg, it->i, t->layer[it->i], t->acc[it->i], t->stride);
+}
+
+/*
+ * Wavefront.  A grid only samples the image it takes its heights from at
+ * its points, and everything else an iteration reads is at the pixel it is
+ * computing.  So once the rows of the image so far that its grid samples
+ * are done, an iteration can follow the one before it down the image, a row
+ * of tiles behind.  Step s computes tile row s - lag[i] of every iteration
+ * i under way, all in one go on the pool.  That way no core sits idle at
+ * the boundary between one iteration and the next, and the tiles each
+ * iteration reads were just written by the one before and are still in
+ * cache.  For when nobody needs a whole image in between: no
+ * iteration_done(), no error report, and the pixel engine.
+ *
+ * Buffers can share memory as plan_buffers() lays them out even though
+ * the iterations overlap in time: everything but the grid samples is read
+ * and written a pixel at a time, and any row of a buffer is done with by
+ * every iteration before a later one gets to that row.
+ */
+struct wavefront {
+	struct terrain *t;
+	struct erosion_job job[MAX_ITERATIONS];
+	struct combine_step combine[MAX_ITERATIONS];
+	int lag[MAX_ITERATIONS]; /* the step computing iteration i's first row of tiles, -1 if skipped */
+	int started[MAX_ITERATIONS]; /* has an erosion job to finish */
+	int tiles_across;
+	int step;
+	int active[MAX_ITERATIONS], nactive; /* the iterations with a row of tiles in this step */
+};
+
+/* How many rows of the image, from the top, grid's points take their heights from */
+static int sampled_rows(struct grid *grid, int dim)
+{
+	int x, y, row, rows = 0;
+
+	for (y = 0; y <= grid->dim; y++) {
+		for (x = 0; x <= grid->dim; x++) {
+			row = image_sample_index(dim, gridpoint(grid, x, y)->x, gridpoint(grid, x, y)->y) / dim;
+			if (row + 1 > rows)
+				rows = row + 1;
+		}
+	}
+	return rows;
+}
+
+/* Allocate iteration i's grid and place its points, for thread_pool_run() over the iterations of terrain arg */
+static void allocate_and_place_grid(void *arg, int i, __attribute__((unused)) int worker)
+{
+	struct terrain *t = arg;
+	const struct iteration_plan *ip = &t->plan.it[i];
+
+	if (ip->skipped || !ip->erode)
+		return;
+	t->grid[i] = allocate_grid(ip->grid_dim, t->r->p->neighborhood_radius);
+	place_iteration_grid(t->r, NULL, t->grid[i], i, t->edit, t->nedits);
+}
+
+/* Before iteration i's first row of tiles: connect its grid and set up its erosion */
+static void wavefront_start(struct wavefront *wf, int i)
+{
+	struct terrain *t = wf->t;
+	const struct iteration_plan *ip = &t->plan.it[i];
+	struct combine_step *c = &wf->combine[i];
+
+	if (!ip->erode)
+		return;
+	connect_grid(t->r->pool, t->r->noise, t->grid[i], t->dim, ip->heights_from_image ? t->acc[i - 1] : NULL,
+			t->stride);
+	c->prog = &ip->combine;
+	c->acc = t->acc[i];
+	c->prev = i > 0 ? t->acc[i - 1] : NULL;
+	c->layer = (const height_t *const *) t->layer;
+	start_erosion(&wf->job[i], t->r, t->layer[i], t->stride, t->grid[i], ip->feature_size, NULL, 0,
+			i > 0 && ip->combines ? c : NULL);
+	wf->job[i].quiet = 1;
+	wf->job[i].tiles_across = wf->tiles_across;
+	wf->started[i] = 1;
+}
+
+static void wavefront_finish(struct wavefront *wf, int i)
+{
+	struct terrain *t = wf->t;
+
+	if (wf->started[i])
+		finish_erosion(&wf->job[i]);
+	wf->started[i] = 0;
+	if (t->grid[i] && !t->keep_stages) {
+		free_grid(t->grid[i]);
+		t->grid[i] = NULL;
+	}
+}
+
+static void wavefront_tile(void *arg, int task, int worker)
+{
+	struct wavefront *wf = arg;
+	struct terrain *t = wf->t;
+	const struct pseudo_erosion_params *p = t->r->p;
+	int i = wf->active[task / wf->tiles_across];
+	int tile = (wf->step - wf->lag[i]) * wf->tiles_across + task % wf->tiles_across;
+	struct combine_job cj;
+	int y, r[4];
+
+	if (i == 0 && p->input) {
+		tile_rect(t->dim, tile, r);
+		for (y = r[1]; y < r[3]; y++)
+			memcpy(&t->layer[0][y * t->stride + r[0]], &p->input[y * p->input_stride + r[0]],
+				sizeof(*p->input) * (r[2] - r[0]));
+	} else if (t->plan.it[i].erode) {
+		erode_tile(&wf->job[i], tile, worker);
+	} else {
+		cj.t = t;
+		cj.iteration = i;
+		cj.tiles = NULL;
+		combine_tile(&cj, tile, worker);
+	}
+}
+
+/* terrain_generate() as a wavefront, with the buffers already laid out */
+static int terrain_wavefront(struct terrain *t)
+{
+	const struct pseudo_erosion_params *p = t->r->p;
+	struct wavefront wf;
+	int i, s, prev, nsteps, dots = 0, rc = 0;
+
+	memset(&wf, 0, sizeof(wf));
+	wf.t = t;
+	wf.tiles_across = (t->dim + TILE_SIZE - 1) / TILE_SIZE;
+	thread_pool_run(t->r->pool, t->plan.niterations, allocate_and_place_grid, t);
+	nsteps = 0;
+	for (i = 0, prev = 0; i < t->plan.niterations; i++) {
+		wf.lag[i] = -1;
+		if (t->plan.it[i].skipped) {
+			if (p->verbose)
+				printf("pseudo-erosion: skipping iteration %d, %s\n", i + 1, t->plan.it[i].skipped);
+			continue;
+		}
+		if (i > 0)
+			wf.lag[i] = wf.lag[prev] + 1;
+		else
+			wf.lag[i] = 0;
+		/* the rows of the image so far it samples must all be done */
+		if (t->plan.it[i].erode && t->plan.it[i].heights_from_image)
+			wf.lag[i] += (sampled_rows(t->grid[i], t->dim) - 1) / TILE_SIZE;
+		nsteps = wf.lag[i] + wf.tiles_across;
+		prev = i;
+	}
+
+	for (s = 0; s < nsteps; s++) {
+		if (p->cancelled && p->cancelled(p->cancel_arg)) {
+			rc = PSEUDO_EROSION_CANCELLED;
+			break;
+		}
+		wf.step = s;
+		wf.nactive = 0;
+		for (i = 0; i < t->plan.niterations; i++) {
+			if (wf.lag[i] < 0 || s < wf.lag[i] || s >= wf.lag[i] + wf.tiles_across)
+				continue;
+			if (s == wf.lag[i])
+				wavefront_start(&wf, i);
+			wf.active[wf.nactive++] = i;
+		}
+		thread_pool_run(t->r->pool, wf.nactive * wf.tiles_across, wavefront_tile, &wf);
+		for (i = 0; i < t->plan.niterations; i++)
+			if (wf.lag[i] >= 0 && s == wf.lag[i] + wf.tiles_across - 1)
+				wavefront_finish(&wf, i);
+		if (p->verbose) {
+			for (; dots < (int) ((int64_t) (s + 1) * t->dim / nsteps); dots++)
+				putchar('.');
+			fflush(stdout);
+		}
+	}
+	if (p->verbose) {
+		printf("\n");
+		fflush(stdout);
+	}
+	for (i = 0; i < t->plan.niterations; i++)
+		if (wf.started[i])
+			wavefront_finish(&wf, i);
+	return rc;
+}
+
+/*
+ * Sparse evaluation.  When only the finished image is wanted, the images in
+ * between are only ever looked at by the grids taking their heights from
+ * them, and only at the grid points.  So instead of computing them, each
+ * such grid gets its heights by running the layers and combine steps
+ * before it at just the pixels its points sample.  Then one pass over the
+ * image computes every layer of a tile in turn, combining as it goes,
+ * straight into the output, with no image sized buffers at all besides the
+ * output.  Each pixel is computed by the same code as always, from the
+ * same grids, so the output is the same.  Except with the scanline kernel,
+ * whose results depend on where each block it is given starts, so it
+ * doesn't get this: the samples would differ from the images.
+ */
+struct sparse {
+	struct terrain *t;
+	height_t *out;
+	struct erosion_job job[MAX_ITERATIONS];
+	int started[MAX_ITERATIONS];
+	int iteration; /* whose grid is being connected */
+	height_t *scratch; /* per worker, a tile of each layer */
+	int tiles_across, tile_row;
+};
+
+/* The image combined through the iterations before n, at pixel (x, y) */
+static height_t sparse_pixel(struct sparse *sp, int n, int x, int y)
+{
+	struct terrain *t = sp->t;
+	const struct pseudo_erosion_params *p = t->r->p;
+	const struct iteration_plan *ip;
+	height_t layer[MAX_ITERATIONS] = { 0 }, a = 0;
+	struct combine_args c;
+	double h;
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		ip = &t->plan.it[i];
+		if (ip->skipped)
+			continue;
+		if (i == 0 && p->input) {
+			layer[0] = p->input[y * p->input_stride + x];
+		} else if (ip->erode) {
+			rect_heights(&sp->job[i], x, y, x + 1, y + 1, &h);
+			layer[i] = h;
+		}
+		if (i == 0) {
+			a = layer[0];
+		} else if (ip->combines) {
+			c.acc = &a;
+			c.prev = &a;
+			c.h = ip->erode ? &layer[i] : NULL;
+			for (j = 0; j < MAX_ITERATIONS; j++)
+				c.layer[j] = ip->combine.layers & (1U << j) ? &layer[j] : NULL;
+			combine_span(&ip->combine, &c, 1);
+		}
+	}
+	return a;
+}
+
+static void sparse_sample_row(void *arg, int y, __attribute__((unused)) int worker)
+{
+	struct sparse *sp = arg;
+	struct grid *g = sp->t->grid[sp->iteration];
+	int x, k, dim = sp->t->dim;
+
+	for (x = 0; x <= g->dim; x++) {
+		k = image_sample_index(dim, gridpoint(g, x, y)->x, gridpoint(g, x, y)->y);
+		g->height[y * (g->dim + 1) + x] = sparse_pixel(sp, sp->iteration, k % dim, k / dim);
+	}
+}
+
+/* Connect iteration i's grid, sampling the image before it sparsely if its heights come from it */
+static void sparse_connect(struct sparse *sp, int i)
+{
+	struct terrain *t = sp->t;
+	const struct iteration_plan *ip = &t->plan.it[i];
+	struct grid *g = t->grid[i];
+
+	if (ip->heights_from_image) {
+		sp->iteration = i;
+		thread_pool_run(t->r->pool, g->dim + 1, sparse_sample_row, sp);
+	} else {
+		grid_point_heights(t->r->pool, t->r->noise, g, t->dim, NULL, 0);
+	}
+	connect_grid_points(t->r->pool, g);
+	start_erosion(&sp->job[i], t->r, NULL, t->stride, g, ip->feature_size, NULL, 0, NULL);
+	sp->job[i].quiet = 1;
+	sp->started[i] = 1;
+}
+
+/* Every layer of a tile, combined into the output as they come */
+static void sparse_tile(void *arg, int task, int worker)
+{
+	struct sparse *sp = arg;
+	struct terrain *t = sp->t;
+	const struct pseudo_erosion_params *p = t->r->p;
+	const struct iteration_plan *ip;
+	height_t *layer = &sp->scratch[(size_t) worker * MAX_ITERATIONS * TILE_SIZE * TILE_SIZE];
+	double h[TILE_SIZE * TILE_SIZE];
+	struct combine_args c;
+	int i, j, x, y, w, r[4];
+
+	tile_rect(t->dim, sp->tile_row * sp->tiles_across + task, r);
+	w = r[2] - r[0];
+#define LAYER_ROW(i, y) (&layer[((i) * TILE_SIZE + (y) - r[1]) * TILE_SIZE])
+	for (i = 0; i < t->plan.niterations; i++) {
+		ip = &t->plan.it[i];
+		if (ip->skipped)
+			continue;
+		if (i == 0 && p->input) {
+			for (y = r[1]; y < r[3]; y++)
+				memcpy(LAYER_ROW(0, y), &p->input[y * p->input_stride + r[0]], sizeof(*layer) * w);
+		} else if (ip->erode) {
+			rect_heights(&sp->job[i], r[0], r[1], r[2], r[3], h);
+			for (y = r[1]; y < r[3]; y++)
+				for (x = 0; x < w; x++)
+					LAYER_ROW(i, y)[x] = h[(y - r[1]) * TILE_SIZE + x];
+		}
+		for (y = r[1]; y < r[3]; y++) {
+			if (i == 0) {
+				memcpy(&sp->out[y * t->stride + r[0]], LAYER_ROW(0, y), sizeof(*layer) * w);
+			} else if (ip->combines) {
+				c.acc = &sp->out[y * t->stride + r[0]];
+				c.prev = c.acc;
+				c.h = ip->erode ? LAYER_ROW(i, y) : NULL;
+				for (j = 0; j < MAX_ITERATIONS; j++)
+					c.layer[j] = ip->combine.layers & (1U << j) ? LAYER_ROW(j, y) : NULL;
+				combine_span(&ip->combine, &c, w);
+			}
+		}
+	}
+#undef LAYER_ROW
+}
+
+/* terrain_generate() by sparse evaluation, into out */
+static int terrain_sparse(struct terrain *t, height_t *out)
+{
+	const struct pseudo_erosion_params *p = t->r->p;
+	struct sparse sp;
+	int i, dots = 0, rc = 0;
+
+	memset(&sp, 0, sizeof(sp));
+	sp.t = t;
+	sp.out = out;
+	sp.tiles_across = (t->dim + TILE_SIZE - 1) / TILE_SIZE;
+	thread_pool_run(t->r->pool, t->plan.niterations, allocate_and_place_grid, t);
+	for (i = 0; i < t->plan.niterations; i++) {
+		if (p->cancelled && p->cancelled(p->cancel_arg)) {
+			rc = PSEUDO_EROSION_CANCELLED;
+			goto out;
+		}
+		if (t->plan.it[i].skipped) {
+			if (p->verbose)
+				printf("pseudo-erosion: skipping iteration %d, %s\n", i + 1, t->plan.it[i].skipped);
+			continue;
+		}
+		if (t->plan.it[i].erode)
+			sparse_connect(&sp, i);
+	}
+
+	sp.scratch = malloc(sizeof(*sp.scratch) * thread_pool_nthreads(t->r->pool) *
+				MAX_ITERATIONS * TILE_SIZE * TILE_SIZE);
+	for (sp.tile_row = 0; sp.tile_row < sp.tiles_across; sp.tile_row++) {
+		if (p->cancelled && p->cancelled(p->cancel_arg)) {
+			rc = PSEUDO_EROSION_CANCELLED;
+			break;
+		}
+		thread_pool_run(t->r->pool, sp.tiles_across, sparse_tile, &sp);
+		if (p->verbose) {
+			for (; dots < (int) ((int64_t) (sp.tile_row + 1) * t->dim / sp.tiles_across); dots++)
+				putchar('.');
+			fflush(stdout);
+		}
+	}
+	if (p->verbose) {
+		printf("\n");
+		fflush(stdout);
+	}
+	free(sp.scratch);
+out:
+	for (i = 0; i < t->plan.niterations; i++)
+		if (sp.started[i])
+			finish_erosion(&sp.job[i]);
+	return rc;
+}
+
+/* terrain_generate() as a task graph, with the buffers already laid out */
+static int terrain_task_graph(struct terrain *t, int written_late)
+{
+	const struct pseudo_erosion_params *p = t->r->p;
+	const struct iteration_plan *ip;
+	struct iteration_task task[MAX_ITERATIONS];
+	struct task_graph *g;
+	int done_through[MAX_ITERATIONS]; /* the last done task of iterations 0 .. i, or -1 */
+	int i, k, place, connect, last = -1;
+
+	atomic_init(&t->stop, 0);
+	g = task_graph_create();
+	for (i = 0; i < t->plan.niterations; i++) {
+		ip = &t->plan.it[i];
+		task[i].t = t;
+		task[i].i = i;
+		connect = -1;
+		if (!ip->skipped && ip->erode) {
+			place = task_graph_add(g, place_grid_task, &task[i], 0);
+			connect = task_graph_add(g, connect_grid_task, &task[i],
+						ip->heights_from_image ? TASK_GRAPH_USES_POOL : 0);
+			task_graph_depends(g, connect, place);
+			if (ip->heights_from_image)
+				task_graph_depends(g, connect, last);
+		}
+		k = task_graph_add(g, iteration_task, &task[i], TASK_GRAPH_USES_POOL);
+		task_graph_depends(g, k, connect);
+		task_graph_depends(g, k, last);
+		/* what the done task before last reads may be reused from here on */
+		if (written_late && i >= 2)
+			task_graph_depends(g, k, done_through[i - 2]);
+		last = k;
+		done_through[i] = i > 0 ? done_through[i - 1] : -1;
+		if (p->iteration_done && !ip->skipped) {
+			k = task_graph_add(g, iteration_done_task, &task[i], 0);
+			task_graph_depends(g, k, last);
+			task_graph_depends(g, k, done_through[i]);
+			done_through[i] = k;
+		}
+	}
+	task_graph_run(g, t->r->pool);
+	task_graph_destroy(g);
+	return atomic_load(&t->stop);
+}
+
+/*
+ * Run the pipeline as plan_pipeline() plans it, cut down by plan_cache()
+ * with a stage cache: by sparse evaluation if only the finished image is
+ * wanted and the kernel is exact, else as a wavefront if no whole images are needed in between,
+ * else, as always with a stage cache, as a task graph.  If the parameters
+ * have an input image, it is used instead of the first iteration.  The
+ * buffers come from the arena as plan_buffers() lays them out, except that
+ * the finished image goes straight into out if that is not NULL, and
+ * unless keep_stages is set each grid is freed as soon as its iteration is
+ * done.  Returns 0, or PSEUDO_EROSION_CANCELLED if the parameters'
+ * cancelled() said to stop or PSEUDO_EROSION_CACHE_ERROR if a cached stage
+ * couldn't be read, in which case the terrain is only good for
+ * terrain_free().
+ */
+static int terrain_generate(struct terrain *t, height_t *out)
+{
+	const struct pseudo_erosion_params *p = t->r->p;
+	struct buffer_plan bp;
+	height_t *slot[NBUFFERS];
+	int i, b, rc, written_late, write_images, whole_images;
+
+	/* with more than one thread, images are written out while the next iteration goes on */
+	written_late = p->iteration_done && thread_pool_nthreads(t->r->pool) > 1;
+	/* every layer computed is stored in the cache */
+	write_images = p->iteration_done || t->cache;
+	plan_pipeline(&t->plan, p, t->keep_stages, write_images, written_late);
+	if (t->cache)
+		plan_cache(t, written_late);
+	whole_images = p->iteration_done || p->error_report || p->engine != PSEUDO_EROSION_PIXEL || t->cache;
+	if (!whole_images && out && !t->keep_stages && strcmp(t->r->kernel_name, "scanline") != 0)
+		return terrain_sparse(t, out);
+	plan_buffers(&bp, &t->plan, t->keep_stages, write_images, written_late);
+	if (t->arena)
+		arena_reset(t->arena);
+	else
+		t->arena = arena_create();
+	for (i = 0; i < bp.nslots; i++)
+		slot[i] = out && i == bp.slot[bp.final] ? out :
+			arena_alloc(t->arena, sizeof(height_t) * t->stride * t->dim);
+	for (i = 0; i < t->plan.niterations; i++) {
+		b = MAX_ITERATIONS + i;
+		if (i == 0) { /* even if skipped, later iterations may read the cache into it */
+			t->layer[0] = t->acc[0] = slot[bp.slot[0]];
+		} else if (t->plan.it[i].skipped) {
+			t->acc[i] = t->acc[i - 1];
+		} else {
+			t->layer[i] = bp.first[b] == i ? slot[bp.slot[b]] : NULL;
+			t->acc[i] = t->plan.it[i].own_image ? slot[bp.slot[i]] : t->acc[i - 1];
+		}
+	}
+
+	if (!whole_images)
+		rc = terrain_wavefront(t);
+	else
+		rc = terrain_task_graph(t, written_late);
+	close_cached_stages(&t->plan);
+
+	/* the buffers are only good through their lifetimes */
+	if (!t->keep_stages)
+		for (i = 1; i < t->plan.niterations; i++)
+			t->layer[i] = NULL;
+	return rc;
+}
+
+static void terrain_free(struct terrain *t)
+{
+	int i;
+
+	for (i = 0; i < MAX_ITERATIONS; i++)
+		if (t->grid[i])
+			free_grid(t->grid[i]);
+	if (t->arena)
+		arena_destroy(t->arena);
+}
+
+/* Mark grid point (x, y) and its Moore neighborhood */
+static void mark_neighborhood(struct grid *g, uint8_t *mark, int x, int y)
+{
+	int i, nx, ny;
+
+	for (i = 0; i < 9; i++) {
+		nx = x + xo[i];
+		ny = y + yo[i];
+		if (nx >= 0 && ny >= 0 && nx <= g->dim && ny <= g->dim)
+			mark[ny * (g->dim + 1) + nx] = 1;
+	}
+}
+
+/*
+ * Apply iteration i's edits to its grid, given the tiles of the image so
+ * far that changed, and recompute the cells of the layer that this
+ * affects, marking their tiles dirty too.  Returns how many cells that was.
+ *
+ *	- A moved grid point changes its own segment and those of the points
+ *	  connected to it, all in its Moore neighborhood, and its height,
+ *	  which its neighbors go by, so they must be reconnected.
+ *	- If heights come from the image so far, points sampling a dirty
+ *	  tile get their heights again and have their neighbors reconnected.
+ *	- A changed segment dirties the cells within neighborhood_radius of
+ *	  its grid point, since those are the cells that search it.
+ */
+static int update_layer(struct terrain *t, int i, const struct pseudo_erosion_edit *edit, int nedits,
+			uint8_t *dirty_tile)
+{
+	int tiles_across = (t->dim + TILE_SIZE - 1) / TILE_SIZE;
+	struct grid *g = t->grid[i];
+	int npoints = (g->dim + 1) * (g->dim + 1);
+	int ncells = g->dim * g->dim;
+	uint8_t *reconnect = calloc(npoints, 1);
+	uint8_t *changed = calloc(npoints, 1);
+	uint8_t *dirty_cell = calloc(ncells, 1);
+	int radius = t->r->p->neighborhood_radius;
+	int fs = t->plan.it[i].feature_size;
+	const height_t *image = t->plan.it[i].heights_from_image ? t->acc[i - 1] : NULL;
+	int k, x, y, cx, cy, gx, gy, n, ndirty_cells, r[4];
+
+	for (k = 0; k < nedits; k++) {
+		if (edit[k].iteration != i)
+			continue;
+		gridpoint(g, edit[k].gx, edit[k].gy)->x = edit[k].x / fs;
+		gridpoint(g, edit[k].gx, edit[k].gy)->y = edit[k].y / fs;
+		g->height[(g->dim + 1) * edit[k].gy + edit[k].gx] =
+			grid_point_height(t->r->noise, g, edit[k].gx, edit[k].gy, t->dim, image, t->stride);
+		mark_neighborhood(g, reconnect, edit[k].gx, edit[k].gy);
+		mark_neighborhood(g, changed, edit[k].gx, edit[k].gy);
+	}
+	if (t->plan.it[i].heights_from_image) {
+		for (y = 0; y <= g->dim; y++) {
+			for (x = 0; x <= g->dim; x++) {
+				k = image_sample_index(t->dim, gridpoint(g, x, y)->x, gridpoint(g, x, y)->y);
+				if (!dirty_tile[(k / t->dim / TILE_SIZE) * tiles_across + (k % t->dim) / TILE_SIZE])
+					continue;
+				g->height[(g->dim + 1) * y + x] = grid_point_height(t->r->noise, g, x, y, t->dim,
+										image, t->stride);
+				mark_neighborhood(g, reconnect, x, y);
+			}
+		}
+	}
+	for (k = 0; k < npoints; k++) {
+		if (!reconnect[k])
+			continue;
+		x = k % (g->dim + 1);
+		y = k / (g->dim + 1);
+		cx = gridpoint(g, x, y)->cx;
+		cy = gridpoint(g, x, y)->cy;
+		connect_grid_point(g, x, y);
+		if (gridpoint(g, x, y)->cx != cx || gridpoint(g, x, y)->cy != cy)
+			changed[k] = 1;
+	}
+	for (k = 0; k < npoints; k++) {
+		if (!changed[k])
+			continue;
+		x = k % (g->dim + 1);
+		y = k / (g->dim + 1);
+		build_segment(g, x, y);
+		for (gy = y - radius; gy <= y + radius; gy++)
+			for (gx = x - radius; gx <= x + radius; gx++)
+				if (gx >= 0 && gy >= 0 && gx < g->dim && gy < g->dim)
+					dirty_cell[gy * g->dim + gx] = 1;
+	}
+
+	ndirty_cells = 0;
+	for (k = 0; k < ncells; k++)
+		if (dirty_cell[k])
+			ndirty_cells++;
+	if (ndirty_cells) {
+		int *cells = malloc(sizeof(*cells) * ndirty_cells);
+
+		n = 0;
+		for (k = 0; k < ncells; k++) {
+			if (!dirty_cell[k])
+				continue;
+			cells[n++] = k;
+			r[0] = cell_start(g, t->dim, k % g->dim);
+			r[1] = cell_start(g, t->dim, k / g->dim);
+			r[2] = cell_start(g, t->dim, k % g->dim + 1);
+			r[3] = cell_start(g, t->dim, k / g->dim + 1);
+			for (y = r[1] / TILE_SIZE; y < tiles_across && y * TILE_SIZE < r[3]; y++)
+				for (x = r[0] / TILE_SIZE; x < tiles_across && x * TILE_SIZE < r[2]; x++)
+					dirty_tile[y * tiles_across + x] = 1;
+		}
+		erode_layer(t->r, t->layer[i], t->stride, g, fs, cells, ndirty_cells, NULL);
+		free(cells);
+	}
+	free(reconnect);
+	free(changed);
+	free(dirty_cell);
+	return ndirty_cells;
+}
+
+/*
+ * Apply edits to a terrain made by terrain_generate() with keep_stages set,
+ * and recompute only what they affect: in each iteration, the cells of the
+ * layer update_layer() finds, then the tiles dirtied so far are
+ * recombined.  So the cost is roughly the footprint of the edits, plus a
+ * pass over the grid points of each later iteration to see what they
+ * sample.
+ */
+static void terrain_update(struct terrain *t, const struct pseudo_erosion_edit *edit, int nedits)
+{
+	int tiles_across = (t->dim + TILE_SIZE - 1) / TILE_SIZE;
+	int ntiles = tiles_across * tiles_across;
+	uint8_t *dirty_tile = calloc(ntiles, 1);
+	int *list, i, k, ncells, ndirty_cells, ndirty_tiles;
+	const struct iteration_plan *ip;
+
+	list = malloc(sizeof(*list) * ntiles);
+	for (i = 0; i < t->plan.niterations; i++) {
+		ip = &t->plan.it[i];
+		if (ip->skipped)
+			continue;
+		ncells = 0;
+		ndirty_cells = 0;
+		if (t->grid[i]) {
+			ncells = t->grid[i]->dim * t->grid[i]->dim;
+			ndirty_cells = update_layer(t, i, edit, nedits, dirty_tile);
+		}
+		ndirty_tiles = 0;
+		for (k = 0; k < ntiles; k++)
+			if (dirty_tile[k])
+				list[ndirty_tiles++] = k;
+		if (ip->combines && ndirty_tiles)
+			combine_iteration(t, i, list, ndirty_tiles);
+		if (t->r->p->verbose)
+			printf("pseudo-erosion: iteration %d: recomputed %d of %d cells, recombined %d of %d tiles\n",
+				i + 1, ndirty_cells, ncells, ip->combines ? ndirty_tiles : 0, ntiles);
+	}
+	free(list);
+	free(dirty_tile);
+}
+
+void pseudo_erosion_default_params(struct pseudo_erosion_params *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->size = 1024;
+	p->grid_size = 4;
+	p->feature_size = 512;
+	p->seed = 123456;
+	p->kernel = "auto";
+	p->neighborhood_radius = 1;
+	p->engine = PSEUDO_EROSION_PIXEL;
+}
+
+static const char *kernel_name(const struct pseudo_erosion_params *p)
+{
+	return p->kernel ? p->kernel : "auto";
+}
+
+void pseudo_erosion_default_pipeline(struct pseudo_erosion_pipeline *pl)
+{
+	*pl = builtin_pipeline;
+}
+
+static int check_iteration(const struct pseudo_erosion_pipeline *pl, int i, char *whynot, int whynotlen)
+{
+	const struct pseudo_erosion_iteration *it = &pl->iteration[i];
+	struct combine_program prog;
+
+	if (it->grid_scale < 1 || it->feature_div < 1)
+		snprintf(whynot, whynotlen, "grid scale and feature divisor must be at least 1");
+	else if (!memchr(it->combine, '\0', sizeof(it->combine)))
+		snprintf(whynot, whynotlen, "expression is too long");
+	else if (i == 0 && it->heights_from_image)
+		snprintf(whynot, whynotlen, "the first iteration has no image to take heights from");
+	else if (i == 0 && it->combine[strspn(it->combine, " \t")])
+		snprintf(whynot, whynotlen, "the first iteration has no combine expression");
+	else if (i > 0)
+		return combine_compile(it->combine, i, &prog, whynot, whynotlen);
+	else
+		return 0;
+	return PSEUDO_EROSION_BAD_PARAMS;
+}
+
+static int check_pipeline(const struct pseudo_erosion_pipeline *pl, char *whynot, int whynotlen)
+{
+	char why[100];
+	int i;
+
+	if (pl->niterations < 1 || pl->niterations > MAX_ITERATIONS) {
+		snprintf(whynot, whynotlen, "a pipeline has 1 to %d iterations", MAX_ITERATIONS);
+		return PSEUDO_EROSION_BAD_PARAMS;
+	}
+	for (i = 0; i < pl->niterations; i++) {
+		if (check_iteration(pl, i, why, sizeof(why))) {
+			snprintf(whynot, whynotlen, "iteration %d: %s", i + 1, why);
+			return PSEUDO_EROSION_BAD_PARAMS;
+		}
+	}
+	return 0;
+}
+
+int pseudo_erosion_parse_pipeline(const char *text, struct pseudo_erosion_pipeline *pl,
+				char *whynot, int whynotlen)
+{
+	struct pseudo_erosion_iteration *it;
+	char line[256], heights[16], why[100], *c;
+	const char *eol;
+	int lineno, n, len;
+
+	memset(pl, 0, sizeof(*pl));
+	for (lineno = 1; *text; lineno++, text = *eol ? eol + 1 : eol) {
+		eol = strchr(text, '\n');
+		if (!eol)
+			eol = text + strlen(text);
+		len = eol - text;
+		if (len >= (int) sizeof(line)) {
+			snprintf(whynot, whynotlen, "line %d: too long", lineno);
+			return PSEUDO_EROSION_BAD_PARAMS;
+		}
+		memcpy(line, text, len);
+		line[len] = '\0';
+		c = strchr(line, '#');
+		if (c)
+			*c = '\0';
+		if (line[strspn(line, " \t\r")] == '\0')
+			continue;
+		if (pl->niterations == MAX_ITERATIONS) {
+			snprintf(whynot, whynotlen, "line %d: more than %d iterations", lineno, MAX_ITERATIONS);
+			return PSEUDO_EROSION_BAD_PARAMS;
+		}
+		it = &pl->iteration[pl->niterations];
+		n = 0;
+		if (sscanf(line, "%d %d %15s %n", &it->grid_scale, &it->feature_div, heights, &n) != 3 ||
+			(strcmp(heights, "noise") != 0 && strcmp(heights, "image") != 0)) {
+			snprintf(whynot, whynotlen,
+				"line %d: expected 'grid_scale feature_div noise|image [expression]'", lineno);
+			return PSEUDO_EROSION_BAD_PARAMS;
+		}
+		it->heights_from_image = strcmp(heights, "image") == 0;
+		for (len = strlen(line); len > n && isspace((unsigned char) line[len - 1]); len--)
+			;
+		line[len] = '\0';
+		if (len - n >= PSEUDO_EROSION_MAX_EXPR) {
+			snprintf(whynot, whynotlen, "line %d: expression is too long", lineno);
+			return PSEUDO_EROSION_BAD_PARAMS;
+		}
+		strcpy(it->combine, &line[n]);
+		if (check_iteration(pl, pl->niterations, why, sizeof(why))) {
+			snprintf(whynot, whynotlen, "line %d: %s", lineno, why);
+			return PSEUDO_EROSION_BAD_PARAMS;
+		}
+		pl->niterations++;
+	}
+	if (pl->niterations == 0) {
+		snprintf(whynot, whynotlen, "no iterations");
+		return PSEUDO_EROSION_BAD_PARAMS;
+	}
+	return 0;
+}
+
+int pseudo_erosion_check_params(const struct pseudo_erosion_params *p, char *whynot, int whynotlen)
+{
+	if (check_pipeline(pipeline(p), whynot, whynotlen))
+		return PSEUDO_EROSION_BAD_PARAMS;
+	if (p->size < 1 || p->grid_size < 1 || p->feature_size < 1) {
+		snprintf(whynot, whynotlen, "size, grid size and feature size must all be at least 1");
+	} else if (p->neighborhood_radius < 1 || p->neighborhood_radius > MAX_NEIGHBORHOOD_RADIUS) {
+		snprintf(whynot, whynotlen, "neighborhood radius must be between 1 and %d",
+			MAX_NEIGHBORHOOD_RADIUS);
+	} else if (p->engine != PSEUDO_EROSION_PIXEL && p->engine != PSEUDO_EROSION_EDT &&
+			p->engine != PSEUDO_EROSION_JFA) {
+		snprintf(whynot, whynotlen, "unknown engine %d", (int) p->engine);
+	} else if (p->noise_lattice < 0 || p->noise_lattice > PSEUDO_EROSION_MAX_NOISE_LATTICE) {
+		snprintf(whynot, whynotlen, "noise lattice must be between 0 and %d samples per unit",
+			PSEUDO_EROSION_MAX_NOISE_LATTICE);
+	} else if (iteration_feature_size(p, 0) < 1) {
+		snprintf(whynot, whynotlen, "the first iteration's features are less than a pixel across");
+	} else if (p->input && p->input_stride < p->size) {
+		snprintf(whynot, whynotlen, "input stride %d is less than the size", p->input_stride);
+	} else if (strcmp(kernel_name(p), "reference") != 0 && !erosion_kernel_select(kernel_name(p), NULL)) {
+		snprintf(whynot, whynotlen, "kernel '%s' is unknown or not supported by this cpu", kernel_name(p));
+	} else {
+		return 0;
+	}
+	return PSEUDO_EROSION_BAD_PARAMS;
+}
+
+/*
+ * Noise contexts are kept for the last few seeds used, so that the same
+ * seed again costs nothing.  They are under 3K each, so a batch or server
+ * worker can keep enough of them around to cycle through a good many seeds.
+ * With noise_lattice, each keeps its lattices too, so only the first run
+ * with a seed pays for sampling them.
+ */
+#define NOISE_CONTEXTS 32
+
+struct pseudo_erosion {
+	struct thread_pool *pool;
+	struct arena *arena;
+	struct grid_noise noise[NOISE_CONTEXTS];
+	int seed[NOISE_CONTEXTS];
+	unsigned long last_used[NOISE_CONTEXTS], clock;
+};
+
+static void free_noise_slices(struct grid_noise *gn)
+{
+	int i;
+
+	for (i = 0; i < NOISE_SLICES; i++) {
+		noise_slice_free(gn->slice[i]);
+		gn->slice[i] = NULL;
+	}
+}
+
+static struct grid_noise *noise_context(struct pseudo_erosion *pe, int seed, int density)
+{
+	struct grid_noise *gn;
+	int i, lru = 0;
+
+	pe->clock++;
+	for (i = 0; i < NOISE_CONTEXTS; i++) {
+		if (pe->noise[i].ctx && pe->seed[i] == seed)
+			break;
+		if (!pe->noise[i].ctx || (pe->noise[lru].ctx && pe->last_used[i] < pe->last_used[lru]))
+			lru = i;
+	}
+	if (i == NOISE_CONTEXTS) {
+		i = lru;
+		if (pe->noise[i].ctx) {
+			free_noise_slices(&pe->noise[i]);
+			open_simplex_noise_free(pe->noise[i].ctx);
+		}
+		open_simplex_noise(seed, &pe->noise[i].ctx);
+		pe->seed[i] = seed;
+	}
+	pe->last_used[i] = pe->clock;
+	gn = &pe->noise[i];
+	if (!gn->slice[0] || gn->density != density) {
+		free_noise_slices(gn);
+		gn->density = density;
+		for (i = 0; i < NOISE_SLICES; i++)
+			gn->slice[i] = noise_slice_create(gn->ctx, noise_slice_at[i].dims,
+						noise_slice_at[i].z, noise_slice_at[i].w, density);
+	}
+	return gn;
+}
+
+/*
+ * Sample the lattices over everywhere the grids can ask about, before
+ * anything runs concurrently.  Grid points sit in [0, size / feature_size]
+ * before the jitter, which moves them less than a grid cell, so a margin
+ * of one unit plus a cell covers them.  Edited points outside that are
+ * still found, just exactly.
+ */
+static void cover_noise(struct thread_pool *pool, struct grid_noise *gn, const struct pseudo_erosion_params *p)
+{
+	double extent = 0.0, cell = 0.0;
+	int i, fs;
+
+	if (!gn->density)
+		return;
+	for (i = 0; i < pipeline(p)->niterations; i++) {
+		fs = iteration_feature_size(p, i);
+		if (fs < 1)
+			continue;
+		if ((double) p->size / fs > extent)
+			extent = (double) p->size / fs;
+		if ((double) p->size / iteration_grid_dim(p, i) / fs > cell)
+			cell = (double) p->size / iteration_grid_dim(p, i) / fs;
+	}
+	for (i = 0; i < NOISE_SLICES; i++)
+		noise_slice_cover(pool, gn->slice[i], -1.0 - cell, -1.0 - cell, extent + 1.0 + cell, extent + 1.0 + cell);
+}
+
+/* The largest error measured in any of the lattices */
+static double noise_max_error(const struct grid_noise *gn)
+{
+	double e, max = 0.0;
+	int i;
+
+	for (i = 0; i < NOISE_SLICES; i++) {
+		e = noise_slice_max_error(gn->slice[i]);
+		if (e > max)
+			max = e;
+	}
+	return max;
+}
+
+struct pseudo_erosion *pseudo_erosion_create(struct thread_pool *pool)
+{
+	struct pseudo_erosion *pe = calloc(1, sizeof(*pe));
+
+	pe->pool = pool;
+	return pe;
+}
+
+void pseudo_erosion_destroy(struct pseudo_erosion *pe)
+{
+	int i;
+
+	if (pe->arena)
+		arena_destroy(pe->arena);
+	for (i = 0; i < NOISE_CONTEXTS; i++) {
+		if (!pe->noise[i].ctx)
+			continue;
+		free_noise_slices(&pe->noise[i]);
+		open_simplex_noise_free(pe->noise[i].ctx);
+	}
+	free(pe);
+}
+
+static int start_run(struct run *r, struct pseudo_erosion *pe, const struct pseudo_erosion_params *p)
+{
+	if (pseudo_erosion_check_params(p, NULL, 0))
+		return PSEUDO_EROSION_BAD_PARAMS;
+	r->p = p;
+	r->pool = pe->pool;
+	r->noise = noise_context(pe, p->seed, p->noise_lattice);
+	cover_noise(pe->pool, r->noise, p);
+	r->kernel = NULL;
+	r->kernel_name = "reference";
+	if (strcmp(kernel_name(p), "reference") != 0)
+		r->kernel = erosion_kernel_select(kernel_name(p), &r->kernel_name);
+	return 0;
+}
+
+int pseudo_erosion_generate(struct pseudo_erosion *pe, const struct pseudo_erosion_params *p,
+				pseudo_erosion_height *out, int stride)
+{
+	struct run r;
+	struct terrain t;
+	int rc;
+
+	if (start_run(&r, pe, p) || stride < p->size)
+		return PSEUDO_EROSION_BAD_PARAMS;
+	memset(&t, 0, sizeof(t));
+	t.r = &r;
+	t.dim = p->size;
+	t.stride = stride;
+	t.arena = pe->arena;
+	if (p->cache_dir) {
+		t.cache = stage_cache_open(p->cache_dir, p->cache_max_bytes);
+		if (!t.cache)
+			fprintf(stderr, "pseudo-erosion: not caching stages, can't use '%s': %s\n",
+				p->cache_dir, strerror(errno));
+	}
+	rc = terrain_generate(&t, out);
+	if (p->verbose && p->noise_lattice)
+		printf("pseudo-erosion: noise interpolated from %d samples per unit, max error measured %.3g\n",
+			p->noise_lattice, noise_max_error(r.noise));
+	stage_cache_close(t.cache);
+	pe->arena = t.arena;
+	t.arena = NULL;
+	terrain_free(&t);
+	return rc;
+}
+
+struct pseudo_erosion_grid {
+	struct grid *grid;
+	int iteration;
+};
+
+struct pseudo_erosion_grid *pseudo_erosion_grid_create(struct pseudo_erosion *pe,
+				const struct pseudo_erosion_params *p, int iteration,
+				const pseudo_erosion_height *image, int stride)
+{
+	struct pseudo_erosion_grid *g;
+	struct run r;
+
+	if (start_run(&r, pe, p) || iteration < 0 || iteration >= pipeline(p)->niterations ||
+		iteration_feature_size(p, iteration) < 1 || (image && stride < p->size))
+		return NULL;
+	g = malloc(sizeof(*g));
+	g->iteration = iteration;
+	g->grid = allocate_grid(iteration_grid_dim(p, iteration), p->neighborhood_radius);
+	setup_grid(&r, g->grid, iteration, NULL, 0, image, stride);
+	return g;
+}
+
+void pseudo_erosion_grid_free(struct pseudo_erosion_grid *g)
+{
+	free_grid(g->grid);
+	free(g);
+}
+
+int pseudo_erosion_erode(struct pseudo_erosion *pe, const struct pseudo_erosion_params *p,
+				struct pseudo_erosion_grid *g, pseudo_erosion_height *out, int stride)
+{
+	struct run r;
+
+	if (start_run(&r, pe, p) || stride < p->size || g->grid->seg.halo < p->neighborhood_radius ||
+		g->iteration >= pipeline(p)->niterations)
+		return PSEUDO_EROSION_BAD_PARAMS;
+	erode_layer(&r, out, stride, g->grid, iteration_feature_size(p, g->iteration), NULL, 0, NULL);
+	return 0;
+}
+
+int pseudo_erosion_combine(const struct pseudo_erosion_params *p, int iteration,
+				pseudo_erosion_height *image, const pseudo_erosion_height *const *layer,
+				int stride)
+{
+	const int r[4] = { 0, 0, p->size, p->size };
+	struct combine_program prog;
+
+	if (pseudo_erosion_check_params(p, NULL, 0) || iteration < 1 ||
+		iteration >= pipeline(p)->niterations || stride < p->size)
+		return PSEUDO_EROSION_BAD_PARAMS;
+	combine_compile(pipeline(p)->iteration[iteration].combine, iteration, &prog, NULL, 0);
+	combine_rect(&prog, image, layer, iteration, stride, r);
+	return 0;
+}
+
+struct pseudo_erosion_terrain {
+	struct pseudo_erosion_params p;
+	struct pseudo_erosion_pipeline pipeline; /* p's, which the caller need not keep */
+	char *kernel; /* likewise */
+	struct terrain t;
+	int from_input; /* there is no first iteration grid to edit */
+};
+
+static int edits_ok(const struct pseudo_erosion_params *p, int from_input,
+			const struct pseudo_erosion_edit *edit, int nedits)
+{
+	int k, n;
+
+	for (k = 0; k < nedits; k++) {
+		if (edit[k].iteration < 0 || edit[k].iteration >= pipeline(p)->niterations ||
+			(edit[k].iteration == 0 && from_input))
+			return 0;
+		n = iteration_grid_dim(p, edit[k].iteration);
+		if (edit[k].gx < 0 || edit[k].gy < 0 || edit[k].gx > n || edit[k].gy > n)
+			return 0;
+	}
+	return 1;
+}
+
+struct pseudo_erosion_terrain *pseudo_erosion_terrain_generate(struct pseudo_erosion *pe,
+				const struct pseudo_erosion_params *p,
+				const struct pseudo_erosion_edit *edit, int nedits)
+{
+	struct pseudo_erosion_terrain *pt;
+	struct run r;
+
+	if (pseudo_erosion_check_params(p, NULL, 0) || !edits_ok(p, p->input != NULL, edit, nedits))
+		return NULL;
+	pt = calloc(1, sizeof(*pt));
+	pt->p = *p;
+	pt->pipeline = *pipeline(p);
+	pt->p.pipeline = &pt->pipeline;
+	if (p->kernel)
+		pt->p.kernel = pt->kernel = strdup(p->kernel);
+	pt->p.cache_dir = NULL; /* terrains don't use the cache */
+	pt->from_input = p->input != NULL;
+	if (start_run(&r, pe, &pt->p)) {
+		free(pt->kernel);
+		free(pt);
+		return NULL;
+	}
+	pt->t.r = &r;
+	pt->t.dim = p->size;
+	pt->t.stride = p->size;
+	pt->t.keep_stages = 1;
+	pt->t.edit = edit;
+	pt->t.nedits = nedits;
+	if (terrain_generate(&pt->t, NULL)) {
+		pseudo_erosion_terrain_free(pt);
+		return NULL;
+	}
+	pt->t.r = NULL;
+	pt->t.edit = NULL;
+	pt->t.nedits = 0;
+	/* only good during the call */
+	pt->p.input = NULL;
+	pt->p.iteration_done = NULL;
+	pt->p.cancelled = NULL;
+	return pt;
+}
+
+int pseudo_erosion_terrain_update(struct pseudo_erosion *pe, struct pseudo_erosion_terrain *pt,
+				const struct pseudo_erosion_edit *edit, int nedits)
+{
+	struct run r;
+
+	if (pt->p.engine != PSEUDO_EROSION_PIXEL || !edits_ok(&pt->p, pt->from_input, edit, nedits) || start_run(&r, pe, &pt->p))
+		return PSEUDO_EROSION_BAD_PARAMS;
+	pt->t.r = &r;
+	terrain_update(&pt->t, edit, nedits);
+	pt->t.r = NULL;
+	return 0;
+}
+
+const pseudo_erosion_height *pseudo_erosion_terrain_layer(struct pseudo_erosion_terrain *pt, int i)
+{
+	return pt->t.layer[i];
+}
+
+const pseudo_erosion_height *pseudo_erosion_terrain_combined(struct pseudo_erosion_terrain *pt, int i)
+{
+	return pt->t.acc[i];
+}
+
+void pseudo_erosion_terrain_free(struct pseudo_erosion_terrain *pt)
+{
+	terrain_free(&pt->t);
+	free(pt->kernel);
+	free(pt);
+}
@@ -0,0 +1,253 @@
+#ifndef LIBPSEUDOEROSION_H__
+#define LIBPSEUDOEROSION_H__
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * libpseudoerosion: the terrain generator, without the command line.
+ *
+ * Heightfields are arrays of pseudo_erosion_height owned by the caller,
+ * size x size, with row y starting at h[y * stride].  They are float, or
+ * double if everything is built with -DPSEUDO_EROSION_DOUBLE_HEIGHTS.
+ *
+ * A struct pseudo_erosion holds what is worth keeping from one call to
+ * the next: the thread pool to run on, an arena for the scratch images,
+ * and the noise contexts of the last few seeds.  Use one per thread.
+ * Nothing else is shared, so separate ones can be used from separate
+ * threads at the same time.
+ *
+ * pseudo_erosion_generate() runs the whole pipeline.  The stages are also
+ * there separately: set up an iteration's grid, erode it into a layer, and
+ * combine the layer into the image so far.  Generating is, for each
+ * iteration i of the pipeline,
+ *
+ *	grid = pseudo_erosion_grid_create(pe, p, i, heights from image ? image : NULL, stride);
+ *	pseudo_erosion_erode(pe, p, grid, i == 0 ? image : layer[i], stride);
+ *	pseudo_erosion_grid_free(grid);
+ *	if (i > 0)
+ *		pseudo_erosion_combine(p, i, image, layer, stride);
+ *
+ * Terrains keep every stage of a generated image so that grid points can be
+ * moved afterwards, recomputing only what that affects.
+ */
+
+struct thread_pool;
+
+#ifdef PSEUDO_EROSION_DOUBLE_HEIGHTS
+typedef double pseudo_erosion_height;
+#else
+typedef float pseudo_erosion_height;
+#endif
+
+#define PSEUDO_EROSION_MAX_ITERATIONS 8
+#define PSEUDO_EROSION_MAX_RADIUS 3
+#define PSEUDO_EROSION_MAX_NOISE_LATTICE 64
+#define PSEUDO_EROSION_MAX_EXPR 128
+
+/* Return values */
+#define PSEUDO_EROSION_BAD_PARAMS (-1)
+#define PSEUDO_EROSION_CANCELLED (-2)
+#define PSEUDO_EROSION_CACHE_ERROR (-3) /* a stage found in the cache couldn't be read */
+
+enum pseudo_erosion_engine {
+	PSEUDO_EROSION_PIXEL, /* test each pixel against the segments nearby */
+	PSEUDO_EROSION_EDT, /* see distance_field.h */
+	PSEUDO_EROSION_JFA,
+};
+
+/*
+ * The pipeline: what each iteration does.  Iteration i erodes a grid of
+ * grid_size * grid_scale cells with features feature_size / feature_div
+ * pixels across (rounded down), the grid points' heights coming from the
+ * noise or from the image combined so far, into a layer.  The first
+ * iteration's layer is the image to start with.  Each later one is combined
+ * into the image pixel by pixel with an expression in
+ *
+ *	a		the image so far
+ *	h		this iteration's layer
+ *	l0 .. l7	an earlier iteration's layer
+ *	numbers, + - * /, unary -, parentheses, sqr(x) and sqrt(x)
+ *
+ * As text, one iteration per line, '#' starting a comment:
+ *
+ *	grid_scale feature_div noise|image [expression]
+ *
+ * The built in pipeline, pseudo_erosion_default_pipeline(), is
+ *
+ *	1 1 noise
+ *	2 2 noise 0.25 * h + 0.5 * a
+ *	4 4 image a + sqr(h)
+ *	8 8 image a + l2 * 0.5 * h
+ *	16 16 image a + sqrt(l2 * l3) * 0.3333 * h
+ *
+ * When generating, iterations whose features would be less than a pixel
+ * across are skipped (the image passes through unchanged), as are those
+ * needing a skipped iteration's layer, and layers nothing uses are not
+ * computed.
+ */
+struct pseudo_erosion_iteration {
+	int grid_scale;
+	int feature_div;
+	int heights_from_image;
+	char combine[PSEUDO_EROSION_MAX_EXPR]; /* unused for the first iteration */
+};
+
+struct pseudo_erosion_pipeline {
+	int niterations; /* 1 to PSEUDO_EROSION_MAX_ITERATIONS */
+	struct pseudo_erosion_iteration iteration[PSEUDO_EROSION_MAX_ITERATIONS];
+};
+
+void pseudo_erosion_default_pipeline(struct pseudo_erosion_pipeline *pl);
+
+/* Parse a pipeline from text as above.  0, or PSEUDO_EROSION_BAD_PARAMS with
+ * the reason in whynot.
+ */
+int pseudo_erosion_parse_pipeline(const char *text, struct pseudo_erosion_pipeline *pl,
+				char *whynot, int whynotlen);
+
+struct pseudo_erosion_params {
+	int size; /* the image is size x size */
+	int grid_size; /* grid cells across the first iteration, doubling each iteration */
+	int feature_size; /* pixels per grid unit in the first iteration, halving each iteration */
+	int seed;
+	const char *kernel; /* see erosion_kernel_select(), or "reference" */
+	/* go tile by tile rather than grid cell by grid cell.  Only matters with
+	 * iteration_done() or error_report, without them the iterations always go
+	 * tile by tile, each following the one before down the image.
+	 */
+	int tile_traversal;
+	int neighborhood_radius; /* 1 to PSEUDO_EROSION_MAX_RADIUS */
+	enum pseudo_erosion_engine engine;
+	int verbose; /* print progress dots, and what terrain updates recompute */
+	int error_report; /* print how each layer differs from the reference code */
+	const struct pseudo_erosion_pipeline *pipeline; /* NULL for the built in one */
+	/* 0 to use the exact noise, else interpolate it from a lattice of this
+	 * many samples per noise unit, sampled once per seed and kept.  Only
+	 * pays when the same seed is used again or the grids are finer than
+	 * the lattice.  With verbose, the largest error measured against the
+	 * exact noise is printed, see noise_slice.h.
+	 */
+	int noise_lattice;
+
+	/* Optional */
+	const pseudo_erosion_height *input; /* used instead of the first iteration */
+	int input_stride;
+	/* called as each iteration is done with its layer and the image combined so far,
+	 * not for skipped iterations.  Calls come in order, one at a time, but with a
+	 * pool of more than one thread, from another thread while the next iteration
+	 * is computed.  The images are only good until it returns.
+	 */
+	void (*iteration_done)(void *arg, int iteration, const pseudo_erosion_height *layer,
+				const pseudo_erosion_height *combined, int stride);
+	void *iteration_arg;
+	int (*cancelled)(void *arg); /* checked before each iteration, nonzero to stop */
+	void *cancel_arg;
+	/* if not NULL, pseudo_erosion_generate() keeps the stages it computes in
+	 * this directory, created if need be, and reuses any already there
+	 * instead of computing them again, see stage_cache.h.  Each layer and
+	 * combined image is keyed by everything it depends on: the seed, the
+	 * sizes, the radius, the engine, which kernels' results it matches, its
+	 * iteration's grid and expression, the input image, and the keys of the
+	 * stages it is made from.  Only the stages the output needs are computed
+	 * or read, so when just the last iteration changes, the earlier ones
+	 * are not even looked at.
+	 */
+	const char *cache_dir;
+	long long cache_max_bytes; /* evict the least recently used stages beyond this, 0 for no limit */
+};
+
+/* The defaults are the command line's: 1024 x 1024, grid 4, feature size 512 */
+void pseudo_erosion_default_params(struct pseudo_erosion_params *p);
+
+/* 0 if p is usable, else PSEUDO_EROSION_BAD_PARAMS with the reason in whynot */
+int pseudo_erosion_check_params(const struct pseudo_erosion_params *p, char *whynot, int whynotlen);
+
+struct pseudo_erosion;
+
+struct pseudo_erosion *pseudo_erosion_create(struct thread_pool *pool); /* pool may be NULL */
+void pseudo_erosion_destroy(struct pseudo_erosion *pe);
+
+/* Generate a heightfield into out.  Returns 0, PSEUDO_EROSION_BAD_PARAMS,
+ * PSEUDO_EROSION_CANCELLED or PSEUDO_EROSION_CACHE_ERROR.  Without
+ * iteration_done(), error_report or a cache_dir, and with the pixel engine,
+ * the images in between are never made, only out.
+ */
+int pseudo_erosion_generate(struct pseudo_erosion *pe, const struct pseudo_erosion_params *p,
+				pseudo_erosion_height *out, int stride);
+
+/* The stages */
+struct pseudo_erosion_grid;
+
+/* The grid for iteration i, the points jittered by the noise and each
+ * connected to its lowest neighbor, the heights coming from image if it is
+ * not NULL, else from the noise.  NULL if p is bad or the iteration is
+ * skipped because its features would be less than a pixel across.
+ */
+struct pseudo_erosion_grid *pseudo_erosion_grid_create(struct pseudo_erosion *pe,
+				const struct pseudo_erosion_params *p, int iteration,
+				const pseudo_erosion_height *image, int stride);
+void pseudo_erosion_grid_free(struct pseudo_erosion_grid *g);
+
+/* Erode a grid into out.  Returns 0 or PSEUDO_EROSION_BAD_PARAMS. */
+int pseudo_erosion_erode(struct pseudo_erosion *pe, const struct pseudo_erosion_params *p,
+				struct pseudo_erosion_grid *g, pseudo_erosion_height *out, int stride);
+
+/* Combine iteration i's layer, layer[i], into image, with layer[j], j < i, for
+ * whichever earlier layers its expression uses.  Returns 0 or
+ * PSEUDO_EROSION_BAD_PARAMS.
+ */
+int pseudo_erosion_combine(const struct pseudo_erosion_params *p, int iteration,
+				pseudo_erosion_height *image, const pseudo_erosion_height *const *layer,
+				int stride);
+
+/* Terrains */
+struct pseudo_erosion_terrain;
+
+/* Move grid point (gx, gy), 0 <= gx, gy <= grid_size * grid_scale, to (x, y) in pixels */
+struct pseudo_erosion_edit {
+	int iteration;
+	int gx, gy;
+	double x, y;
+};
+
+/* Generate a terrain with the nedits edits applied as each grid is set
+ * up.  NULL if p is bad or generating was cancelled.  The terrain keeps
+ * its own copy of p, its pipeline and kernel name, so the caller's need
+ * not outlive the call.  Terrains don't use p->cache_dir.
+ */
+struct pseudo_erosion_terrain *pseudo_erosion_terrain_generate(struct pseudo_erosion *pe,
+				const struct pseudo_erosion_params *p,
+				const struct pseudo_erosion_edit *edit, int nedits);
+
+/* Apply edits to t, recomputing just the parts they affect.  Needs the
+ * pixel engine.  Returns 0 or PSEUDO_EROSION_BAD_PARAMS.
+ */
+int pseudo_erosion_terrain_update(struct pseudo_erosion *pe, struct pseudo_erosion_terrain *t,
+				const struct pseudo_erosion_edit *edit, int nedits);
+
+/* Iteration i's layer (NULL if it wasn't computed), and the image combined
+ * through iteration i, size x size with stride size
+ */
+const pseudo_erosion_height *pseudo_erosion_terrain_layer(struct pseudo_erosion_terrain *t, int i);
+const pseudo_erosion_height *pseudo_erosion_terrain_combined(struct pseudo_erosion_terrain *t, int i);
+void pseudo_erosion_terrain_free(struct pseudo_erosion_terrain *t);
+
+#endif
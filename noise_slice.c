@@ -0,0 +1,249 @@
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "open-simplex-noise.h"
+#include "thread_pool.h"
+#include "noise_slice.h"
+
+#define EVAL_CHUNK 64 /* points per call to evaluate() */
+#define ERROR_STRIDE 4 /* measure the error in every 4th new cell each way */
+
+struct noise_slice {
+	struct osn_context *ctx;
+	int dims;
+	double z, w;
+	int density; /* samples per unit, 0 for exact */
+	/* The lattice: sample[(j - j0) * nx + i - i0] is the noise at
+	 * (i / density, j / density), for i0 <= i < i0 + nx, j0 <= j < j0 + ny.
+	 */
+	int i0, j0, nx, ny;
+	double *sample;
+	double max_error;
+};
+
+/* The exact noise */
+static void evaluate(const struct noise_slice *s, const double *x, const double *y, double *out, int n)
+{
+	int i;
+
+	if (s->dims == 3)
+		for (i = 0; i < n; i++)
+			out[i] = open_simplex_noise3(s->ctx, x[i], y[i], s->z);
+	else
+		open_simplex_noise4_slice_array(s->ctx, x, y, s->z, s->w, out, n);
+}
+
+struct noise_slice *noise_slice_create(struct osn_context *ctx, int dims, double z, double w,
+					int density)
+{
+	struct noise_slice *s = calloc(1, sizeof(*s));
+
+	s->ctx = ctx;
+	s->dims = dims;
+	s->z = z;
+	s->w = w;
+	s->density = density;
+	return s;
+}
+
+void noise_slice_free(struct noise_slice *s)
+{
+	if (!s)
+		return;
+	free(s->sample);
+	free(s);
+}
+
+static inline double catmull_rom(double p0, double p1, double p2, double p3, double t)
+{
+	return p1 + 0.5 * t * (p2 - p0 + t * (2.0 * p0 - 5.0 * p1 + 4.0 * p2 - p3 +
+			t * (3.0 * (p1 - p2) + p3 - p0)));
+}
+
+/* Interpolate the noise at (x, y) into *value.  0 if the lattice doesn't cover (x, y). */
+static int interpolate(const struct noise_slice *s, double x, double y, double *value)
+{
+	double u = x * s->density, v = y * s->density;
+	double fu = floor(u), fv = floor(v), r[4];
+	const double *row;
+	int i, j, k;
+
+	/* in doubles first, so that points far outside can't overflow an int */
+	if (!(fu - s->i0 >= 1 && fu - s->i0 + 2 < s->nx && fv - s->j0 >= 1 && fv - s->j0 + 2 < s->ny))
+		return 0;
+	i = (int) fu - s->i0;
+	j = (int) fv - s->j0;
+	row = &s->sample[(j - 1) * s->nx + i - 1];
+	for (k = 0; k < 4; k++, row += s->nx)
+		r[k] = catmull_rom(row[0], row[1], row[2], row[3], u - fu);
+	*value = catmull_rom(r[0], r[1], r[2], r[3], v - fv);
+	return 1;
+}
+
+void noise_slice_eval(const struct noise_slice *s, const double *x, const double *y,
+			double *out, int n)
+{
+	int i;
+
+	if (!s->density) {
+		evaluate(s, x, y, out, n);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		if (!interpolate(s, x[i], y[i], &out[i]))
+			evaluate(s, &x[i], &y[i], &out[i], 1);
+}
+
+double noise_slice_max_error(const struct noise_slice *s)
+{
+	return s->max_error;
+}
+
+struct lattice_job {
+	struct noise_slice *s;
+	const double *old; /* the lattice before it grew, or NULL */
+	int oi0, oj0, onx, ony;
+	double *error; /* per worker */
+};
+
+/* Sample lattice row j from i = ia up to ib into out */
+static void sample_run(const struct noise_slice *s, int j, int ia, int ib, double *out)
+{
+	double x[EVAL_CHUNK], y[EVAL_CHUNK];
+	int i, k, n;
+
+	for (i = ia; i < ib; i += n) {
+		n = ib - i < EVAL_CHUNK ? ib - i : EVAL_CHUNK;
+		for (k = 0; k < n; k++) {
+			x[k] = (double) (i + k) / s->density;
+			y[k] = (double) j / s->density;
+		}
+		evaluate(s, x, y, out + (i - ia), n);
+	}
+}
+
+/* Fill in a row of the grown lattice, copying what the old one had */
+static void fill_row(void *arg, int row, __attribute__((unused)) int worker)
+{
+	struct lattice_job *lj = arg;
+	const struct noise_slice *s = lj->s;
+	int j = s->j0 + row, oi1 = lj->oi0 + lj->onx;
+	double *out = &s->sample[row * s->nx];
+
+	if (!lj->old || j < lj->oj0 || j >= lj->oj0 + lj->ony) {
+		sample_run(s, j, s->i0, s->i0 + s->nx, out);
+		return;
+	}
+	sample_run(s, j, s->i0, lj->oi0, out);
+	memcpy(out + lj->oi0 - s->i0, &lj->old[(j - lj->oj0) * lj->onx], sizeof(*out) * lj->onx);
+	sample_run(s, j, oi1, s->i0 + s->nx, out + oi1 - s->i0);
+}
+
+/* Could the old lattice interpolate cell (i, j), the one from sample (i, j) to (i + 1, j + 1)? */
+static int old_cell(const struct lattice_job *lj, int i, int j)
+{
+	return lj->old && i - 1 >= lj->oi0 && i + 2 < lj->oi0 + lj->onx &&
+		j - 1 >= lj->oj0 && j + 2 < lj->oj0 + lj->ony;
+}
+
+/* Measure the error at the middle of every ERROR_STRIDEth new cell along one row of cells */
+static void measure_row(void *arg, int task, int worker)
+{
+	struct lattice_job *lj = arg;
+	const struct noise_slice *s = lj->s;
+	int j = s->j0 + 1 + task * ERROR_STRIDE;
+	double x[EVAL_CHUNK], y[EVAL_CHUNK], exact[EVAL_CHUNK], approx;
+	int i, k, n = 0;
+
+	for (i = s->i0 + 1; i + 2 < s->i0 + s->nx; i += ERROR_STRIDE) {
+		if (old_cell(lj, i, j))
+			continue;
+		x[n] = (i + 0.5) / s->density;
+		y[n] = (j + 0.5) / s->density;
+		if (++n < EVAL_CHUNK && i + ERROR_STRIDE + 2 < s->i0 + s->nx)
+			continue;
+		evaluate(s, x, y, exact, n);
+		for (k = 0; k < n; k++)
+			if (interpolate(s, x[k], y[k], &approx) && fabs(approx - exact[k]) > lj->error[worker])
+				lj->error[worker] = fabs(approx - exact[k]);
+		n = 0;
+	}
+	if (n) {
+		evaluate(s, x, y, exact, n);
+		for (k = 0; k < n; k++)
+			if (interpolate(s, x[k], y[k], &approx) && fabs(approx - exact[k]) > lj->error[worker])
+				lj->error[worker] = fabs(approx - exact[k]);
+	}
+}
+
+void noise_slice_cover(struct thread_pool *pool, struct noise_slice *s,
+			double x0, double y0, double x1, double y1)
+{
+	struct lattice_job lj;
+	int i0, j0, i1, j1, margin, k, nworkers;
+
+	if (!s->density)
+		return;
+	/* the samples interpolating anywhere in the box needs */
+	i0 = (int) floor(x0 * s->density) - 1;
+	j0 = (int) floor(y0 * s->density) - 1;
+	i1 = (int) floor(x1 * s->density) + 2;
+	j1 = (int) floor(y1 * s->density) + 2;
+	if (s->sample && i0 >= s->i0 && j0 >= s->j0 && i1 < s->i0 + s->nx && j1 < s->j0 + s->ny)
+		return;
+
+	/* Grow to take in the old lattice too, and a margin, so that a run of
+	 * slightly bigger boxes doesn't mean resampling each time.
+	 */
+	if (s->sample) {
+		i0 = i0 < s->i0 ? i0 : s->i0;
+		j0 = j0 < s->j0 ? j0 : s->j0;
+		i1 = i1 > s->i0 + s->nx - 1 ? i1 : s->i0 + s->nx - 1;
+		j1 = j1 > s->j0 + s->ny - 1 ? j1 : s->j0 + s->ny - 1;
+	}
+	margin = 2 * s->density;
+	lj.s = s;
+	lj.old = s->sample;
+	lj.oi0 = s->i0;
+	lj.oj0 = s->j0;
+	lj.onx = s->nx;
+	lj.ony = s->ny;
+	s->i0 = i0 - margin;
+	s->j0 = j0 - margin;
+	s->nx = i1 - i0 + 1 + 2 * margin;
+	s->ny = j1 - j0 + 1 + 2 * margin;
+	s->sample = malloc(sizeof(*s->sample) * s->nx * s->ny);
+	thread_pool_run(pool, s->ny, fill_row, &lj);
+
+	nworkers = thread_pool_nthreads(pool);
+	lj.error = calloc(nworkers, sizeof(*lj.error));
+	thread_pool_run(pool, (s->ny - 3 + ERROR_STRIDE - 1) / ERROR_STRIDE, measure_row, &lj);
+	for (k = 0; k < nworkers; k++)
+		if (lj.error[k] > s->max_error)
+			s->max_error = lj.error[k];
+	free(lj.error);
+	free((double *) lj.old);
+}
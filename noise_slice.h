@@ -0,0 +1,68 @@
+#ifndef NOISE_SLICE_H__
+#define NOISE_SLICE_H__
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * A plane through the noise, z = constant in 3D or z, w = constants in 4D,
+ * as the grids sample it for jitter and heights.  Evaluated exactly, or,
+ * optionally, interpolated from a lattice of exact samples: bicubic
+ * (Catmull-Rom) interpolation of samples at (i / density, j / density).
+ * The lattice is sampled as queries need it, grows to cover new ones, and
+ * is kept for as long as the slice is, so queries sampled densely compared
+ * with the noise's features, or made over and over, cost a few
+ * multiplies and adds each instead of a trip through the simplex lattice.
+ * An interpolated value depends only on the samples around it, never on
+ * how far the lattice happens to extend, so results are repeatable.
+ *
+ * The error is measured, not bounded: each time the lattice grows, the
+ * interpolation is compared against the exact noise at the middle of
+ * every fourth new cell each way, about the worst place in a cell.
+ */
+
+struct osn_context;
+struct thread_pool;
+struct noise_slice;
+
+/* The plane z (and w, for dims == 4) through ctx's noise, exact if density
+ * is 0, else interpolated from density samples per unit.
+ */
+struct noise_slice *noise_slice_create(struct osn_context *ctx, int dims, double z, double w,
+					int density);
+void noise_slice_free(struct noise_slice *s);
+
+/* Get ready to interpolate anywhere in [x0, x1] x [y0, y1], sampling
+ * whatever more of the lattice that needs on pool.  Nothing to do for an
+ * exact slice.  Must not be called while anything else uses s.
+ */
+void noise_slice_cover(struct thread_pool *pool, struct noise_slice *s,
+			double x0, double y0, double x1, double y1);
+
+/* out[i] = the noise at (x[i], y[i]).  Points not covered are evaluated
+ * exactly.  Any number of threads may evaluate at once.
+ */
+void noise_slice_eval(const struct noise_slice *s, const double *x, const double *y,
+			double *out, int n);
+
+/* The largest interpolation error measured so far, 0 for an exact slice */
+double noise_slice_max_error(const struct noise_slice *s);
+
+#endif
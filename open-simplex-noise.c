@@ -34,12 +34,22 @@
 	
 #define DEFAULT_SEED (0LL)
 
+/*
+ * Everything the noise looks anything up in, in one 64 byte aligned block
+ * of under 3K.  perm is only ever used masked to its low 8 bits, so a
+ * uint8_t holds it exactly.  The gradients are resolved up front: gradN[i]
+ * is the gradient extrapolateN() arrives at through slot i of perm, which
+ * saves it the last of its chain of dependent lookups.
+ */
 struct osn_context {
-	int16_t *perm;
-	int16_t *permGradIndex3D;
+	uint8_t perm[256];
+	int8_t grad2[256][2];
+	int8_t grad3[256][4]; /* the 4th is just padding */
+	int8_t grad4[256][4];
 };
 
 #define ARRAYSIZE(x) (sizeof((x)) / sizeof((x)[0]))
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
 
 /* 
  * Gradients for 2D. They approximate the directions to the
@@ -96,30 +106,29 @@ static const signed char gradients4D[] = {
 
 static double extrapolate2(struct osn_context *ctx, int xsb, int ysb, double dx, double dy)
 {
-	int16_t *perm = ctx->perm;	
-	int index = perm[(perm[xsb & 0xFF] + ysb) & 0xFF] & 0x0E;
-	return gradients2D[index] * dx
-		+ gradients2D[index + 1] * dy;
+	uint8_t *perm = ctx->perm;
+	int8_t *g = ctx->grad2[(perm[xsb & 0xFF] + ysb) & 0xFF];
+	return g[0] * dx
+		+ g[1] * dy;
 }
 	
 static double extrapolate3(struct osn_context *ctx, int xsb, int ysb, int zsb, double dx, double dy, double dz)
 {
-	int16_t *perm = ctx->perm;	
-	int16_t *permGradIndex3D = ctx->permGradIndex3D;
-	int index = permGradIndex3D[(perm[(perm[xsb & 0xFF] + ysb) & 0xFF] + zsb) & 0xFF];
-	return gradients3D[index] * dx
-		+ gradients3D[index + 1] * dy
-		+ gradients3D[index + 2] * dz;
+	uint8_t *perm = ctx->perm;
+	int8_t *g = ctx->grad3[(perm[(perm[xsb & 0xFF] + ysb) & 0xFF] + zsb) & 0xFF];
+	return g[0] * dx
+		+ g[1] * dy
+		+ g[2] * dz;
 }
 	
 static double extrapolate4(struct osn_context *ctx, int xsb, int ysb, int zsb, int wsb, double dx, double dy, double dz, double dw)
 {
-	int16_t *perm = ctx->perm;
-	int index = perm[(perm[(perm[(perm[xsb & 0xFF] + ysb) & 0xFF] + zsb) & 0xFF] + wsb) & 0xFF] & 0xFC;
-	return gradients4D[index] * dx
-		+ gradients4D[index + 1] * dy
-		+ gradients4D[index + 2] * dz
-		+ gradients4D[index + 3] * dw;
+	uint8_t *perm = ctx->perm;
+	int8_t *g = ctx->grad4[(perm[(perm[(perm[xsb & 0xFF] + ysb) & 0xFF] + zsb) & 0xFF] + wsb) & 0xFF];
+	return g[0] * dx
+		+ g[1] * dy
+		+ g[2] * dz
+		+ g[3] * dw;
 }
 	
 static inline int fastFloor(double x) {
@@ -127,36 +136,34 @@ static inline int fastFloor(double x) {
 	return x < xi ? xi - 1 : xi;
 }
 	
-static int allocate_perm(struct osn_context *ctx, int nperm, int ngrad)
+/* Fill in ctx from the permutation p */
+static void set_perm(struct osn_context *ctx, const int16_t p[256])
 {
-	if (ctx->perm)
-		free(ctx->perm);
-	if (ctx->permGradIndex3D)
-		free(ctx->permGradIndex3D);
-	ctx->perm = malloc(sizeof(*ctx->perm) * nperm); 
-	if (!ctx->perm)
-		return -ENOMEM;
-	ctx->permGradIndex3D = malloc(sizeof(*ctx->permGradIndex3D) * ngrad);
-	if (!ctx->permGradIndex3D) {
-		free(ctx->perm);
-		return -ENOMEM;
+	int i, j, index;
+
+	for (i = 0; i < 256; i++) {
+		ctx->perm[i] = (uint8_t) p[i];
+		index = p[i] & 0x0E;
+		for (j = 0; j < 2; j++)
+			ctx->grad2[i][j] = gradients2D[index + j];
+		//Since 3D has 24 gradients, simple bitmask won't work, so precompute modulo array.
+		index = (p[i] % (ARRAYSIZE(gradients3D) / 3)) * 3;
+		for (j = 0; j < 3; j++)
+			ctx->grad3[i][j] = gradients3D[index + j];
+		ctx->grad3[i][3] = 0;
+		index = p[i] & 0xFC;
+		for (j = 0; j < 4; j++)
+			ctx->grad4[i][j] = gradients4D[index + j];
 	}
-	return 0;
 }
 	
 int open_simplex_noise_init_perm(struct osn_context *ctx, int16_t p[], int nelements)
 {
-	int i, rc;
+	int16_t perm[256];
 
-	rc = allocate_perm(ctx, nelements, 256);
-	if (rc)
-		return rc;
-	memcpy(ctx->perm, p, sizeof(*ctx->perm) * nelements);
-		
-	for (i = 0; i < 256; i++) {
-		//Since 3D has 24 gradients, simple bitmask won't work, so precompute modulo array.
-		ctx->permGradIndex3D[i] = (int16_t)((ctx->perm[i] % (ARRAYSIZE(gradients3D) / 3)) * 3);
-	}
+	memset(perm, 0, sizeof(perm));
+	memcpy(perm, p, sizeof(*perm) * (nelements < 256 ? nelements : 256));
+	set_perm(ctx, perm);
 	return 0;
 }
 
@@ -167,26 +174,14 @@ int open_simplex_noise_init_perm(struct osn_context *ctx, int16_t p[], int nelem
  */
 int open_simplex_noise(int64_t seed, struct osn_context **ctx)
 {
-	int rc;
 	int16_t source[256];
+	int16_t perm[256];
+	void *mem;
 	int i;
-	int16_t *perm;
-	int16_t *permGradIndex3D;
 
-	*ctx = malloc(sizeof(**ctx));
-	if (!(*ctx))
+	if (posix_memalign(&mem, 64, sizeof(**ctx)))
 		return -ENOMEM;
-	(*ctx)->perm = NULL;
-	(*ctx)->permGradIndex3D = NULL;
-
-	rc = allocate_perm(*ctx, 256, 256);
-	if (rc) {
-		free(*ctx);
-		return rc;
-	}
-
-	perm = (*ctx)->perm;
-	permGradIndex3D = (*ctx)->permGradIndex3D;
+	*ctx = mem;
 
 	for (i = 0; i < 256; i++)
 		source[i] = (int16_t) i;
@@ -199,24 +194,14 @@ int open_simplex_noise(int64_t seed, struct osn_context **ctx)
 		if (r < 0)
 			r += (i + 1);
 		perm[i] = source[r];
-		permGradIndex3D[i] = (short)((perm[i] % (ARRAYSIZE(gradients3D) / 3)) * 3);
 		source[r] = source[i];
 	}
+	set_perm(*ctx, perm);
 	return 0;
 }
 
 void open_simplex_noise_free(struct osn_context *ctx)
 {
-	if (!ctx)
-		return;
-	if (ctx->perm) {
-		free(ctx->perm);
-		ctx->perm = NULL;	
-	}
-	if (ctx->permGradIndex3D) {
-		free(ctx->permGradIndex3D);
-		ctx->permGradIndex3D = NULL;
-	}
 	free(ctx);
 }
 	
@@ -337,9 +322,10 @@ double open_simplex_noise2(struct osn_context *ctx, double x, double y)
 }
 	
 /*
- * 3D OpenSimplex (Simplectic) Noise
+ * 3D OpenSimplex (Simplectic) Noise.  Always inlined, so that the slice
+ * evaluators below get their own copies, specialized for their plane.
  */
-double open_simplex_noise3(struct osn_context *ctx, double x, double y, double z)
+ALWAYS_INLINE double noise3(struct osn_context *ctx, double x, double y, double z)
 {
 
 	//Place input coordinates on simplectic honeycomb.
@@ -903,7 +889,7 @@ double open_simplex_noise3(struct osn_context *ctx, double x, double y, double z
 /* 
  * 4D OpenSimplex (Simplectic) Noise.
  */
-double open_simplex_noise4(struct osn_context *ctx, double x, double y, double z, double w)
+ALWAYS_INLINE double noise4(struct osn_context *ctx, double x, double y, double z, double w)
 {
 
 	//Place input coordinates on simplectic honeycomb.
@@ -2217,3 +2203,63 @@ double open_simplex_noise4(struct osn_context *ctx, double x, double y, double z
 	return value / NORM_CONSTANT_4D;
 }
 	
+
+double open_simplex_noise3(struct osn_context *ctx, double x, double y, double z)
+{
+	return noise3(ctx, x, y, z);
+}
+
+double open_simplex_noise4(struct osn_context *ctx, double x, double y, double z, double w)
+{
+	return noise4(ctx, x, y, z, w);
+}
+
+/*
+ * There is no SIMD path for many points at once.  The cost of the noise is
+ * almost all in picking out each point's region of the lattice and its
+ * vertices, which branches differently for every point and doesn't
+ * vectorize.  Gathering each point's vertices and evaluating them with AVX2
+ * or AVX-512 came out slower than calling the functions above point by point.
+ *
+ * The 4D slice evaluator, with a copy of the traversal for each plane it
+ * is faster on for the compiler to specialize.  Where w is the very same
+ * value as z, the copy is given z for both, so zs and ws, zsb and wsb,
+ * zins and wins and dz0 and dw0 are all one value each.  Everything done
+ * with them is done once, and the copy for z = w = 0 folds in the zeros
+ * too.  The arithmetic is otherwise untouched, so the results are exactly
+ * those of noise4().  There is no 3D one: fixing z, even at a constant,
+ * leaves nothing to fold in, as z only enters by way of x + y + z.
+ */
+static void noise4_diagonal_slice(struct osn_context *ctx, const double *x, const double *y,
+				double z, double *out, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		out[i] = noise4(ctx, x[i], y[i], z, z);
+}
+
+static void noise4_zero_slice(struct osn_context *ctx, const double *x, const double *y,
+				double *out, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		out[i] = noise4(ctx, x[i], y[i], 0.0, 0.0);
+}
+
+void open_simplex_noise4_slice_array(struct osn_context *ctx, const double *x, const double *y,
+				double z, double w, double *out, int n)
+{
+	int i;
+
+	/* bit for bit the same, as -0.0 == 0.0 but isn't interchangeable with it */
+	if (memcmp(&z, &w, sizeof(z)) != 0) {
+		for (i = 0; i < n; i++)
+			out[i] = noise4(ctx, x[i], y[i], z, w);
+	} else if (z == 0.0 && !signbit(z)) {
+		noise4_zero_slice(ctx, x, y, out, n);
+	} else {
+		noise4_diagonal_slice(ctx, x, y, z, out, n);
+	}
+}
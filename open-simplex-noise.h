@@ -29,4 +29,13 @@ double open_simplex_noise2(struct osn_context *ctx, double x, double y);
 double open_simplex_noise3(struct osn_context *ctx, double x, double y, double z);
 double open_simplex_noise4(struct osn_context *ctx, double x, double y, double z, double w);
 
+/*
+ * The 4D noise for n points on a plane through the lattice, at fixed z and
+ * w: out[i] gets exactly open_simplex_noise4(ctx, x[i], y[i], z, w).
+ * Faster than the general version where w == z, most of all for z = w = 0.
+ * A plain loop, not SIMD, see open-simplex-noise.c.
+ */
+void open_simplex_noise4_slice_array(struct osn_context *ctx, const double *x, const double *y,
+				double z, double w, double *out, int n);
+
 #endif
@@ -20,10 +20,13 @@
 */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
 #include <png.h>
 
+#include "png_utils.h"
+
 int png_utils_write_png_image(const char *filename, unsigned char *pixels, int w, int h, int has_alpha, int invert)
 {
 	png_structp png_ptr;
@@ -92,6 +95,57 @@ cleanup1:
 	return rc;
 }
 
+/*
+ * Write a png one row at a time, fill_row(arg, y, row) supplying each row
+ * as png wants it (bit_depth 16 samples big endian), so no copy of the
+ * whole image is ever made.  color_type is a PNG_COLOR_TYPE_*.
+ */
+int png_utils_write_png_rows(const char *filename, int w, int h, int bit_depth, int color_type,
+				png_utils_fill_row_fn fill_row, void *arg)
+{
+	png_structp png_ptr;
+	png_infop info_ptr;
+	png_byte *volatile row = NULL; /* set after setjmp(), freed after a longjmp() */
+	int y, rc = -1, channels;
+	FILE *f;
+
+	f = fopen(filename, "w");
+	if (!f) {
+		fprintf(stderr, "fopen: %s:%s\n", filename, strerror(errno));
+		return -1;
+	}
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png_ptr)
+		goto cleanup1;
+	info_ptr = png_create_info_struct(png_ptr);
+	if (!info_ptr)
+		goto cleanup2;
+	if (setjmp(png_jmpbuf(png_ptr)))
+		goto cleanup3;
+
+	png_set_IHDR(png_ptr, info_ptr, (size_t) w, (size_t) h, bit_depth, color_type,
+			PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+			PNG_FILTER_TYPE_DEFAULT);
+	channels = png_get_channels(png_ptr, info_ptr);
+	row = png_malloc(png_ptr, (size_t) w * channels * bit_depth / 8);
+	png_init_io(png_ptr, f);
+	png_write_info(png_ptr, info_ptr);
+	for (y = 0; y < h; y++) {
+		fill_row(arg, y, row);
+		png_write_row(png_ptr, row);
+	}
+	png_write_end(png_ptr, info_ptr);
+	rc = 0;
+cleanup3:
+	if (row)
+		png_free(png_ptr, row);
+cleanup2:
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+cleanup1:
+	fclose(f);
+	return rc;
+}
+
 char *png_utils_read_png_image(const char *filename, int flipVertical, int flipHorizontal,
 	int pre_multiply_alpha,
 	int *w, int *h, int *hasAlpha, char *whynot, int whynotlen)
@@ -23,6 +23,9 @@
 #include <png.h>
 
 int png_utils_write_png_image(const char *filename, unsigned char *pixels, int w, int h, int has_alpha, int invert);
+typedef void (*png_utils_fill_row_fn)(void *arg, int y, unsigned char *row);
+int png_utils_write_png_rows(const char *filename, int w, int h, int bit_depth, int color_type,
+				png_utils_fill_row_fn fill_row, void *arg);
 
 char *png_utils_read_png_image(const char *filename, int flipVertical, int flipHorizontal,
         int pre_multiply_alpha,
@@ -24,21 +24,32 @@
 #include <string.h>
 #include <stdint.h>
 #include <math.h>
+#include <errno.h>
+#include <time.h>
 #include <getopt.h>
+#include <unistd.h>
+#include <stdatomic.h>
 
-#include "open-simplex-noise.h"
 #include "png_utils.h"
+#include "thread_pool.h"
+#include "serve.h"
+#include "libpseudoerosion.h"
 
-#define DEFAULT_IMAGE_SIZE 1024
-#define DEFAULT_FEATURE_SIZE 512
-#define DEFAULT_GRID_SIZE 4
-
+static struct pseudo_erosion_params params; /* size, seed, kernel, ... see libpseudoerosion.h */
 static char *output_file = "output.png";
-static int image_size = DEFAULT_IMAGE_SIZE;
-static int feature_size = DEFAULT_FEATURE_SIZE;
-static int grid_size = DEFAULT_GRID_SIZE;
-static int seed = 123456;
 static char *input_image = NULL;
+static int nthreads = 1;
+static struct thread_pool *pool = NULL;
+static char *edit_file = NULL;
+static int output_bits = 8;
+static int write_intermediates = 1;
+static char *batch_file = NULL;
+static char *socket_path = NULL;
+static char *pipeline_file = NULL;
+static int cache_megabytes = 1024;
+static struct pseudo_erosion_pipeline pipeline;
+
+typedef pseudo_erosion_height height_t;
 
 static struct option long_options[] = {
 	{ "featuresize", required_argument, NULL, 'f' },
@@ -47,6 +58,21 @@ static struct option long_options[] = {
 	{ "seed", required_argument, NULL, 'S' },
 	{ "outputfile", required_argument, NULL, 'o' },
 	{ "input", required_argument, NULL, 'i' },
+	{ "threads", required_argument, NULL, 't' },
+	{ "kernel", required_argument, NULL, 'k' },
+	{ "traversal", required_argument, NULL, 'T' },
+	{ "error-report", no_argument, NULL, 'E' },
+	{ "neighborhood-radius", required_argument, NULL, 'r' },
+	{ "engine", required_argument, NULL, 'e' },
+	{ "edits", required_argument, NULL, 'd' },
+	{ "bits", required_argument, NULL, 'b' },
+	{ "no-intermediates", no_argument, NULL, 'n' },
+	{ "batch", required_argument, NULL, 'B' },
+	{ "serve", required_argument, NULL, 'L' },
+	{ "pipeline", required_argument, NULL, 'p' },
+	{ "cache", required_argument, NULL, 'c' },
+	{ "cache-size", required_argument, NULL, 'C' },
+	{ "noise-lattice", required_argument, NULL, 'a' },
 	{ 0, 0, 0, 0 },
 };
 
@@ -54,215 +80,77 @@ static void usage(void)
 {
 	fprintf(stderr, "pseudo_erosion: Usage:\n\n");
 	fprintf(stderr, "	pseudo_erosion [-g gridsize] [-o outputfile] [-s imagesize] \\\n");
-	fprintf(stderr, "		[-i inputfile] [-f featuresize]\n");
+	fprintf(stderr, "		[-i inputfile] [-f featuresize] [-t threads] [-k kernel] \\\n");
+	fprintf(stderr, "		[-T traversal] [-E] [-r radius] [-e engine] \\\n");
+	fprintf(stderr, "		[-d editfile] [-b bits] [-n] [-B jobfile] [-L socket] \\\n");
+	fprintf(stderr, "		[-p pipelinefile] [-c cachedir] [-C megabytes] [-a samples]\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "	-t threads: number of threads, 0 means one per cpu (default 1)\n");
+	fprintf(stderr, "	-k kernel: reference, scalar, sse2, avx2, avx512, scanline or auto (default auto)\n");
+	fprintf(stderr, "	-T traversal: cell (grid cell by grid cell) or tile (default cell),\n");
+	fprintf(stderr, "		the reference kernel always uses tile, and so does everything when\n");
+	fprintf(stderr, "		only the output image is wanted (with -n, and for -B and -L), since\n");
+	fprintf(stderr, "		then each iteration follows the one before down the image a row of\n");
+	fprintf(stderr, "		tiles behind\n");
+	fprintf(stderr, "	-E: compare each iteration against the reference kernel and report the error\n");
+	fprintf(stderr, "	-r radius: search grid points up to radius cells away, 1 to %d (default 1)\n",
+		PSEUDO_EROSION_MAX_RADIUS);
+	fprintf(stderr, "	-e engine: pixel (test each pixel against nearby segments, default),\n");
+	fprintf(stderr, "		edt (exact distance transform) or jfa (jump flooding, approximate)\n");
+	fprintf(stderr, "	-d editfile: generate, then move the grid points listed in editfile, one\n");
+	fprintf(stderr, "		'iteration gx gy x y' per line (x, y in pixels), and recompute\n");
+	fprintf(stderr, "		just the parts affected.  With -E, check against generating from scratch\n");
+	fprintf(stderr, "	-b bits: 8 (RGBA, default) or 16 (grayscale) bits per pixel in the output images\n");
+	fprintf(stderr, "	-n: only write the output image, not img-a.png ... img5.png, which also\n");
+	fprintf(stderr, "		saves the memory of the layers that are only kept to be written out\n");
+	fprintf(stderr, "	-B jobfile: render every job in jobfile, one 'seed size gridsize featuresize\n");
+	fprintf(stderr, "		outputfile' per line, writing just each job's output image.  Small jobs\n");
+	fprintf(stderr, "		run side by side, one per thread, large ones use all the threads\n");
+	fprintf(stderr, "	-L socket: serve jobs over a unix domain socket until told to shut down,\n");
+	fprintf(stderr, "		one job per thread at a time, see serve.h for the protocol\n");
+	fprintf(stderr, "	-p pipelinefile: what each iteration does instead of the built in five,\n");
+	fprintf(stderr, "		one 'gridscale featuredivisor noise|image [expression]' per line,\n");
+	fprintf(stderr, "		see libpseudoerosion.h\n");
+	fprintf(stderr, "	-c cachedir: keep each iteration's layer and combined image in cachedir\n");
+	fprintf(stderr, "		and reuse them in later runs, so that changing just the last\n");
+	fprintf(stderr, "		iterations recomputes only those.  Not used with -d\n");
+	fprintf(stderr, "	-C megabytes: how big cachedir may get, least recently used stages\n");
+	fprintf(stderr, "		going first, 0 for no limit (default 1024)\n");
+	fprintf(stderr, "	-a samples: interpolate the noise from a lattice of this many samples per\n");
+	fprintf(stderr, "		noise unit, 1 to %d, sampled once per seed, instead of evaluating it\n",
+		PSEUDO_EROSION_MAX_NOISE_LATTICE);
+	fprintf(stderr, "		exactly (the default).  Approximate, faster for fine grids or seeds\n");
+	fprintf(stderr, "		used again, and prints the largest error measured\n");
 	fprintf(stderr, "\n");
 	exit(1);
 }
 
-struct grid_point {
-	double x, y;
-	int cx, cy; /* connected to gridpoint(grid, cx, cy) */
-};
-
-struct grid {
-	struct grid_point *g;
-	int dim;
-};
-
-static struct grid *allocate_grid(int dim)
+static height_t *allocate_image(int dim)
 {
-	struct grid_point *gp;
-	struct grid *g;
-
-	gp = malloc(sizeof(*gp) * (dim + 1) * (dim + 1));
-	memset(gp, 0,  sizeof(*gp) * (dim + 1) * (dim + 1));
-	g = malloc(sizeof(*g));
-	g->g = gp;
-	g->dim = dim;
-	return g;
-}
-
-static void free_grid(struct grid *grid)
-{
-	free(grid->g);
-	grid->g = NULL;
-	free(grid);
-}
-
-static inline struct grid_point *gridpoint(struct grid *grid, int x, int y)
-{
-	return &grid->g[(grid->dim + 1) * y + x];
-}
-
-static uint32_t *allocate_image(int dim)
-{
-	unsigned char *image;
-
-	image = malloc(4 * dim * dim);
-	memset(image, 0, 4 * dim * dim);
-	return (uint32_t *) image;
+	return calloc((size_t) dim * dim, sizeof(height_t));
 }
 
+/* Heights are only quantized on the way out, clipped to [-1, 1] */
 static inline uint32_t noise_to_color(double noise)
 {
-	uint32_t rgb = (0x0ff << 24) | (0x010101 * (uint32_t) ((noise + 1) * 127.5));
-	return rgb;
-}
-
-static inline double color_to_noise(uint32_t color)
-{
-	int value = color & 0x0ff;
-	return ((double) value / 127.5) - 1.0;
-}
-
-/* Offsets for Moore neighborhood, including self */
-static const int xo[] = { -1, 0, 1, 1, 1, 0, -1, -1, 0 };
-static const int yo[] = { -1, -1, -1, 0, 1, 1, 1, 0, 0 };
+	uint32_t rgb;
 
-static void setup_grid_points(struct osn_context *ctx, struct grid *grid, const double dim, const double feature_size)
-{
-	int i, x, y;
-	double xoffset, yoffset;
-
-	for (y = 0; y < grid->dim + 1; y++) {
-		for (x = 0; x < grid->dim + 1; x++) {
-			double ox, oy;
-			ox = ((double) x * dim / (double) grid->dim / feature_size);
-			oy = ((double) y * dim / (double) grid->dim / feature_size);
-			xoffset = 0.5 * open_simplex_noise3(ctx, ox, oy, 25.7) * dim / grid->dim / feature_size;
-			yoffset = 0.5 * open_simplex_noise3(ctx, ox, oy, 95.9) * dim / grid->dim / feature_size;
-			gridpoint(grid, x, y)->x = ox + xoffset;
-			gridpoint(grid, x, y)->y = oy + yoffset;
-		}
-	}
-	/* Set up connections. Each grid point is "connected to" it's lowest neighbor,
-	 * (possibly itself)
-	 */
-	for (y = 0; y < grid->dim + 1; y++) {
-		for (x = 0; x < grid->dim + 1; x++) {
-			int lown = -1;
-			double lowest_value = 100000.0;
-			/* Find the lowest neighbor, lown (index into xo[], yo[]) */
-			for (i = 0; i < 9; i++) { /* Check Moore neighborhood */
-				int nx, ny;
-				double value;
-				double px, py;
-				nx = x + xo[i];
-				ny = y + yo[i];
-				if (nx < 0 || nx > grid->dim || ny < 0 || ny > grid->dim)
-					continue;
-				px = gridpoint(grid, nx, ny)->x;
-				py = gridpoint(grid, nx, ny)->y;
-				value = open_simplex_noise4(ctx, px, py, 0.0, 0.0);
-				if (value < lowest_value) {
-					lown = i;
-					lowest_value = value;
-				}
-			}
-			/* Set the connection to lowest neighbor */
-			gridpoint(grid, x, y)->cx = x + xo[lown];
-			gridpoint(grid, x, y)->cy = y + yo[lown];
-		}
-	}
+	noise = noise < -1.0 ? -1.0 : (noise > 1.0 ? 1.0 : noise);
+	rgb = (0x0ff << 24) | (0x010101 * (uint32_t) ((noise + 1) * 127.5));
+	return rgb;
 }
 
-static void setup_grid_points_from_image(struct osn_context *ctx, struct grid *grid,
-		const double dim, const double feature_size, uint32_t *image)
+static inline uint16_t noise_to_gray16(double noise)
 {
-	int i, x, y;
-	double xoffset, yoffset;
-
-	for (y = 0; y < grid->dim + 1; y++) {
-		for (x = 0; x < grid->dim + 1; x++) {
-			double ox, oy;
-			ox = ((double) x * dim / (double) grid->dim / feature_size);
-			oy = ((double) y * dim / (double) grid->dim / feature_size);
-			xoffset = 0.5 * open_simplex_noise3(ctx, ox, oy, 25.7) * dim / grid->dim / feature_size;
-			yoffset = 0.5 * open_simplex_noise3(ctx, ox, oy, 95.9) * dim / grid->dim / feature_size;
-			gridpoint(grid, x, y)->x = ox + xoffset;
-			gridpoint(grid, x, y)->y = oy + yoffset;
-		}
-	}
-	/* Set up connections. Each grid point is "connected to" it's lowest neighbor,
-	 * (possibly itself)
-	 */
-	for (y = 0; y < grid->dim + 1; y++) {
-		for (x = 0; x < grid->dim + 1; x++) {
-			int lown = -1;
-			double lowest_value = 100000.0;
-			/* Find the lowest neighbor, lown (index into xo[], yo[]) */
-			for (i = 0; i < 9; i++) { /* Check Moore neighborhood */
-				int nx, ny;
-				double value;
-				double px, py;
-				nx = x + xo[i];
-				ny = y + yo[i];
-				if (nx < 0 || nx > grid->dim || ny < 0 || ny > grid->dim)
-					continue;
-				px = gridpoint(grid, nx, ny)->x;
-				py = gridpoint(grid, nx, ny)->y;
-				value = color_to_noise(image[(int) (py * dim + px)]);
-				if (value < lowest_value) {
-					lown = i;
-					lowest_value = value;
-				}
-			}
-			/* Set the connection to lowest neighbor */
-			gridpoint(grid, x, y)->cx = x + xo[lown];
-			gridpoint(grid, x, y)->cy = y + yo[lown];
-		}
-	}
+	noise = noise < -1.0 ? -1.0 : (noise > 1.0 ? 1.0 : noise);
+	return (uint16_t) ((noise + 1) * 32767.5);
 }
 
-static inline double sqr(double x)
+static inline double color_to_noise(unsigned char value)
 {
-	return x * x;
+	return ((double) value / 127.5) - 1.0;
 }
 
-static void pseudo_erosion(uint32_t *image, struct osn_context *ctx, struct grid *grid, int dim, float feature_size)
-{
-	int i, x, y, gx, gy, cx, cy, ngx, ngy;
-	double f1, f2, x1, y1, x2, y2, px, py, h;
-
-	for (y = 0; y < dim; y++) {
-		ngy = grid->dim * y / dim;
-		for (x = 0; x < dim; x++) { /* For each pixel... */
-			double minh = 10000.0;
-			ngx = grid->dim * x / dim;
-			for (i = 0; i < 9; i++) {
-				gx = ngx + xo[i];
-				gy = ngy + yo[i];
-				if (gx < 0 || gy < 0 || gx > grid->dim || gy > grid->dim)
-					continue;
-				px = (double) x / feature_size;
-				py = (double) y / feature_size;
-				x1 = gridpoint(grid, gx, gy)->x;
-				y1 = gridpoint(grid, gx, gy)->y;
-				cx = gridpoint(grid, gx, gy)->cx;
-				cy = gridpoint(grid, gx, gy)->cy;
-				x2 = gridpoint(grid, cx, cy)->x;
-				y2 = gridpoint(grid, cx, cy)->y;
-				f1 = ((y1 - y2) * (py - y1) + (x1 - x2) * (px - x1)) / (sqr(y1 - y2) + sqr(x1 - x2));
-				if (f1 > 0.0) {
-					h = sqrt(sqr(px - x1) + sqr(py - y1));
-				} else if (f1 < -1.0) {
-					h = sqrt(sqr(px - x2) + sqr(py - y2));
-				} else {
-					f2 = fabs(((y1 - y2) * (px - x1) - (x1 - x2) * (py - y1)) /
-							sqrt(sqr(x1 - x2) + sqr(y1 - y2)));
-					h = f2;
-				}
-				if (h < minh)
-					minh = h;
-			}
-			image[y * dim + x] = noise_to_color(minh);
-		}
-		printf(".");
-		fflush(stdout);
-	}
-	printf("\n");
-	fflush(stdout);
-}
 
 static void process_int_option(char *option_name, char *option_value, int *value)
 {
@@ -282,27 +170,106 @@ static void process_options(int argc, char *argv[])
 
 	while (1) {
 		int option_index;
-		c = getopt_long(argc, argv, "f:g:i:o:s:S:", long_options, &option_index);
+		c = getopt_long(argc, argv, "a:b:B:c:C:d:e:Ef:g:i:k:L:no:p:r:s:S:t:T:", long_options, &option_index);
 		if (c == -1)
 			break;
 		switch (c) {
+		case 'a':
+			process_int_option("noise-lattice", optarg, &params.noise_lattice);
+			if (params.noise_lattice < 1 || params.noise_lattice > PSEUDO_EROSION_MAX_NOISE_LATTICE) {
+				fprintf(stderr, "Noise lattice must be between 1 and %d samples per unit\n",
+					PSEUDO_EROSION_MAX_NOISE_LATTICE);
+				usage();
+			}
+			break;
+		case 'b':
+			process_int_option("bits", optarg, &output_bits);
+			if (output_bits != 8 && output_bits != 16) {
+				fprintf(stderr, "Bits per pixel must be 8 or 16\n");
+				usage();
+			}
+			break;
+		case 'B':
+			batch_file = optarg;
+			break;
+		case 'c':
+			params.cache_dir = optarg;
+			break;
+		case 'C':
+			process_int_option("cache-size", optarg, &cache_megabytes);
+			if (cache_megabytes < 0) {
+				fprintf(stderr, "Cache size must not be negative\n");
+				usage();
+			}
+			break;
+		case 'L':
+			socket_path = optarg;
+			break;
+		case 'd':
+			edit_file = optarg;
+			break;
+		case 'n':
+			write_intermediates = 0;
+			break;
+		case 'e':
+			if (strcmp(optarg, "pixel") == 0) {
+				params.engine = PSEUDO_EROSION_PIXEL;
+			} else if (strcmp(optarg, "edt") == 0) {
+				params.engine = PSEUDO_EROSION_EDT;
+			} else if (strcmp(optarg, "jfa") == 0) {
+				params.engine = PSEUDO_EROSION_JFA;
+			} else {
+				fprintf(stderr, "Bad engine option '%s'\n", optarg);
+				usage();
+			}
+			break;
+		case 'E':
+			params.error_report = 1;
+			break;
 		case 'f':
-			process_int_option("size", optarg, &feature_size);
+			process_int_option("size", optarg, &params.feature_size);
 			break;
 		case 'g':
-			process_int_option("size", optarg, &grid_size);
+			process_int_option("size", optarg, &params.grid_size);
 			break;
 		case 'i':
 			input_image = optarg;
 			break;
+		case 'k':
+			params.kernel = optarg;
+			break;
 		case 'o':
 			output_file = optarg;
 			break;
+		case 'p':
+			pipeline_file = optarg;
+			break;
+		case 'r':
+			process_int_option("neighborhood-radius", optarg, &params.neighborhood_radius);
+			if (params.neighborhood_radius < 1 || params.neighborhood_radius > PSEUDO_EROSION_MAX_RADIUS) {
+				fprintf(stderr, "Neighborhood radius must be between 1 and %d\n",
+					PSEUDO_EROSION_MAX_RADIUS);
+				usage();
+			}
+			break;
 		case 's':
-			process_int_option("size", optarg, &image_size);
+			process_int_option("size", optarg, &params.size);
 			break;
 		case 'S':
-			process_int_option("seed", optarg, &seed);
+			process_int_option("seed", optarg, &params.seed);
+			break;
+		case 't':
+			process_int_option("threads", optarg, &nthreads);
+			break;
+		case 'T':
+			if (strcmp(optarg, "cell") == 0) {
+				params.tile_traversal = 0;
+			} else if (strcmp(optarg, "tile") == 0) {
+				params.tile_traversal = 1;
+			} else {
+				fprintf(stderr, "Bad traversal option '%s'\n", optarg);
+				usage();
+			}
 			break;
 		default:
 			fprintf(stderr, "pseudo_erosion: Unknown option '%s'\n",
@@ -315,155 +282,523 @@ static void process_options(int argc, char *argv[])
 	return;
 }
 
-/* Combine images a,b as a + 0.5*b */
-static void combine_images_f1(uint32_t *im1, uint32_t *im2, int imsize)
+struct export_job {
+	const height_t *h;
+	int dim, stride;
+};
+
+static void fill_rgba_row(void *arg, int y, unsigned char *row)
 {
-	int x, y;
-
-	for (y = 0; y < imsize; y++) {
-		for (x = 0; x < imsize; x++) {
-			double n1, n2;
-			uint32_t c1 = im1[y * imsize + x];
-			uint32_t c2 = im2[y * imsize + x];
-			n1 = color_to_noise(c1);
-			n2 = color_to_noise(c2);
-			n1 = 0.25 * n2 + 0.5 * n1;
-			im1[y * imsize + x] = noise_to_color(n1);
-		}
+	struct export_job *ej = arg;
+	uint32_t c;
+	int x;
+
+	for (x = 0; x < ej->dim; x++) {
+		c = noise_to_color(ej->h[y * ej->stride + x]);
+		memcpy(&row[4 * x], &c, 4);
 	}
 }
 
-/* Combine images a,b as a + sqr(b) */
-static void combine_images_f2(uint32_t *im1, uint32_t *im2, int imsize)
+static void fill_gray16_row(void *arg, int y, unsigned char *row)
 {
-	int x, y;
-
-	for (y = 0; y < imsize; y++) {
-		for (x = 0; x < imsize; x++) {
-			double n1, n2;
-			uint32_t c1 = im1[y * imsize + x];
-			uint32_t c2 = im2[y * imsize + x];
-			n1 = color_to_noise(c1);
-			n2 = color_to_noise(c2);
-			n1 = n2 * n2 + n1;
-			im1[y * imsize + x] = noise_to_color(n1);
-		}
+	struct export_job *ej = arg;
+	uint16_t v;
+	int x;
+
+	for (x = 0; x < ej->dim; x++) { /* png wants big endian */
+		v = noise_to_gray16(ej->h[y * ej->stride + x]);
+		row[2 * x] = v >> 8;
+		row[2 * x + 1] = v & 0x0ff;
 	}
 }
 
-/* Combine images a,b,c as a + b * 0.5 * c */
-static void combine_images_f3(uint32_t *im1, uint32_t *im2, uint32_t *im3, int imsize)
+/* Quantize a heightfield to output_bits and write it out, a row at a time.
+ * Returns 0, or -1 if the file couldn't be written.
+ */
+static int write_heightfield(const char *name, const height_t *h, int dim, int stride)
 {
-	int x, y;
-
-	for (y = 0; y < imsize; y++) {
-		for (x = 0; x < imsize; x++) {
-			double n1, n2, n3;
-			uint32_t c1 = im1[y * imsize + x];
-			uint32_t c2 = im2[y * imsize + x];
-			uint32_t c3 = im3[y * imsize + x];
-			n1 = color_to_noise(c1);
-			n2 = color_to_noise(c2);
-			n3 = color_to_noise(c3);
-			n1 = n1 + n2 * 0.5 * n3;
-			im1[y * imsize + x] = noise_to_color(n1);
+	struct export_job ej;
+
+	ej.h = h;
+	ej.dim = dim;
+	ej.stride = stride;
+	if (output_bits == 16)
+		return png_utils_write_png_rows(name, dim, dim, 16, PNG_COLOR_TYPE_GRAY, fill_gray16_row, &ej);
+	return png_utils_write_png_rows(name, dim, dim, 8, PNG_COLOR_TYPE_RGBA, fill_rgba_row, &ej);
+}
+
+/* Convert an 8 bit png, just its first channel, to a heightfield dim x dim */
+static height_t *read_heightfield(const char *name, int *dim)
+{
+	unsigned char *pixels;
+	height_t *h;
+	int x, y, w, ht, a, stride;
+	char whynot[100];
+
+	pixels = (unsigned char *) png_utils_read_png_image(name, 0, 0, 0, &w, &ht, &a, whynot, 100);
+	if (!pixels) {
+		fprintf(stderr, "pseudo_erosion: %s: %s\n", name, whynot);
+		exit(1);
+	}
+	stride = (w * (a ? 4 : 3) + 3) & ~3; /* rows are padded to 4 bytes */
+	*dim = w < ht ? w : ht;
+	h = allocate_image(*dim);
+	for (y = 0; y < *dim; y++)
+		for (x = 0; x < *dim; x++)
+			h[y * *dim + x] = color_to_noise(pixels[y * stride + x * (a ? 4 : 3)]);
+	free(pixels);
+	return h;
+}
+
+
+/* Write the final heightfield to output_file, or exit if it can't be */
+static void write_output(const height_t *h)
+{
+	if (write_heightfield(output_file, h, params.size, params.size)) {
+		fprintf(stderr, "pseudo_erosion: '%s' couldn't be written\n", output_file);
+		exit(1);
+	}
+}
+
+static void write_iteration_images(__attribute__((unused)) void *arg, int i, const height_t *layer,
+				const height_t *combined, int stride)
+{
+	char name[20];
+
+	if (!layer) /* skipped */
+		return;
+	if (i > 0) {
+		sprintf(name, "img%d.png", i + 1);
+		write_heightfield(name, layer, params.size, stride);
+	}
+	sprintf(name, "img-%c.png", 'a' + i);
+	write_heightfield(name, combined, params.size, stride);
+}
+
+static void read_pipeline(const char *filename)
+{
+	char *text = NULL, whynot[120];
+	size_t n = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f) {
+		fprintf(stderr, "pseudo_erosion: %s: %s\n", filename, strerror(errno));
+		exit(1);
+	}
+	do {
+		text = realloc(text, n + 4096 + 1);
+		n += fread(&text[n], 1, 4096, f);
+	} while (!feof(f) && !ferror(f));
+	text[n] = '\0';
+	fclose(f);
+	if (pseudo_erosion_parse_pipeline(text, &pipeline, whynot, sizeof(whynot))) {
+		fprintf(stderr, "pseudo_erosion: %s: %s\n", filename, whynot);
+		exit(1);
+	}
+	free(text);
+}
+
+/* Read edits, one per line: iteration (1 to the number of iterations) gx gy x y, # comments */
+static struct pseudo_erosion_edit *read_edits(const char *filename, int *nedits)
+{
+	struct pseudo_erosion_edit *edit = NULL, e;
+	char line[256];
+	int n = 0, lineno = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f) {
+		fprintf(stderr, "pseudo_erosion: %s: %s\n", filename, strerror(errno));
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (line[strspn(line, " \t\r\n")] == '\0' || line[strspn(line, " \t")] == '#')
+			continue;
+		if (sscanf(line, "%d %d %d %lf %lf", &e.iteration, &e.gx, &e.gy, &e.x, &e.y) != 5 ||
+			e.iteration < 1 || e.iteration > pipeline.niterations ||
+			(e.iteration == 1 && input_image) || e.gx < 0 || e.gy < 0 ||
+			e.gx > params.grid_size * pipeline.iteration[e.iteration - 1].grid_scale ||
+			e.gy > params.grid_size * pipeline.iteration[e.iteration - 1].grid_scale) {
+			fprintf(stderr, "pseudo_erosion: %s:%d: bad edit\n", filename, lineno);
+			exit(1);
 		}
+		e.iteration--;
+		edit = realloc(edit, sizeof(*edit) * (n + 1));
+		edit[n++] = e;
+	}
+	fclose(f);
+	*nedits = n;
+	return edit;
+}
+
+/* The library only says PSEUDO_EROSION_BAD_PARAMS, read_edits() has checked the rest */
+static void edits_failed(const char *filename)
+{
+	fprintf(stderr, "pseudo_erosion: %s: can't apply the edits, %s\n", filename,
+		params.engine != PSEUDO_EROSION_PIXEL ? "they need the pixel engine (-e pixel)" :
+		"an edit is out of range");
+	exit(1);
+}
+
+/* For -E with --edits: compare the updated terrain with one generated from scratch with the edits */
+static void update_report(struct pseudo_erosion *pe, struct pseudo_erosion_terrain *t,
+				const struct pseudo_erosion_edit *edit, int nedits)
+{
+	struct pseudo_erosion_terrain *full;
+	const height_t *a, *b;
+	int64_t ndiffer = 0;
+	int i, k;
+
+	full = pseudo_erosion_terrain_generate(pe, &params, edit, nedits);
+	if (!full)
+		edits_failed(edit_file);
+	for (i = 0; i < pipeline.niterations; i++) {
+		a = pseudo_erosion_terrain_layer(t, i);
+		b = pseudo_erosion_terrain_layer(full, i);
+		for (k = 0; a && k < params.size * params.size; k++)
+			ndiffer += a[k] != b[k];
+		a = pseudo_erosion_terrain_combined(t, i);
+		b = pseudo_erosion_terrain_combined(full, i);
+		for (k = 0; k < params.size * params.size; k++)
+			ndiffer += a[k] != b[k];
+	}
+	printf("pseudo-erosion: update vs. generating from scratch: %lld pixels differ\n", (long long) ndiffer);
+	pseudo_erosion_terrain_free(full);
+}
+
+/*
+ * What a thread rendering one job after another (in batch or server mode)
+ * keeps between jobs: its generator, which holds on to the scratch memory
+ * and the noise contexts of the last few seeds, and a buffer for the output.
+ */
+struct render_worker {
+	struct pseudo_erosion *pe;
+	height_t *out;
+	size_t out_size;
+};
+
+static struct render_worker *create_render_workers(int n, struct thread_pool *p)
+{
+	struct render_worker *w = calloc(n, sizeof(*w));
+	int i;
+
+	for (i = 0; i < n; i++)
+		w[i].pe = pseudo_erosion_create(p);
+	return w;
+}
+
+static void free_render_workers(struct render_worker *w, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		pseudo_erosion_destroy(w[i].pe);
+		free(w[i].out);
 	}
+	free(w);
 }
 
-/* Combine images a,b,c,d as a + sqrt(b * c) * 0.3333 * d */
-static void combine_images_f4(uint32_t *im1, uint32_t *im2, uint32_t *im3, uint32_t *im4, int imsize)
+/* Generate a size x size heightfield into w->out */
+static int render(struct render_worker *w, const struct pseudo_erosion_params *p)
 {
-	int x, y;
-
-	for (y = 0; y < imsize; y++) {
-		for (x = 0; x < imsize; x++) {
-			double n1, n2, n3, n4;
-			uint32_t c1 = im1[y * imsize + x];
-			uint32_t c2 = im2[y * imsize + x];
-			uint32_t c3 = im3[y * imsize + x];
-			uint32_t c4 = im4[y * imsize + x];
-			n1 = color_to_noise(c1);
-			n2 = color_to_noise(c2);
-			n3 = color_to_noise(c3);
-			n4 = color_to_noise(c4);
-			n1 = n1 + sqrt(n2 * n3) * 0.3333 * n4;
-			im1[y * imsize + x] = noise_to_color(n1);
+	size_t n = (size_t) p->size * p->size;
+
+	if (w->out_size < n) {
+		free(w->out);
+		w->out = malloc(sizeof(*w->out) * n);
+		w->out_size = n;
+	}
+	return pseudo_erosion_generate(w->pe, p, w->out, p->size);
+}
+
+/* Why rendering p failed with rc, into whynot */
+static void render_failed_why(int rc, const struct pseudo_erosion_params *p, char *whynot, int n)
+{
+	if (rc != PSEUDO_EROSION_BAD_PARAMS || !pseudo_erosion_check_params(p, whynot, n))
+		snprintf(whynot, n, "%s", rc == PSEUDO_EROSION_CACHE_ERROR ?
+			"a cached stage couldn't be read" : "rendering failed");
+}
+
+/*
+ * Batch mode.  Every job is rendered in this one process, each pool worker
+ * reusing its render_worker from job to job.  Jobs of at most
+ * BATCH_SMALL_JOB_PIXELS run side by side, one per worker, each single
+ * threaded, and bigger jobs then run one at a time with the whole pool.
+ */
+#define BATCH_SMALL_JOB_PIXELS (512 * 512)
+
+struct batch_job {
+	int seed, size, grid_size, feature_size;
+	char *output;
+};
+
+struct batch {
+	struct batch_job *job;
+	int njobs;
+	int *small; /* indices of the small jobs */
+	struct render_worker *worker; /* one per pool worker, single threaded */
+	struct render_worker *big; /* on the whole pool */
+	atomic_int failed;
+};
+
+static struct batch_job *read_batch_jobs(const char *filename, int *njobs)
+{
+	struct batch_job *job = NULL, j;
+	char line[1200], output[1024];
+	int n = 0, lineno = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f) {
+		fprintf(stderr, "pseudo_erosion: %s: %s\n", filename, strerror(errno));
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (line[strspn(line, " \t\r\n")] == '\0' || line[strspn(line, " \t")] == '#')
+			continue;
+		if (sscanf(line, "%d %d %d %d %1023s", &j.seed, &j.size, &j.grid_size,
+				&j.feature_size, output) != 5 ||
+			j.size < 1 || j.grid_size < 1 || j.feature_size < 1) {
+			fprintf(stderr, "pseudo_erosion: %s:%d: bad job\n", filename, lineno);
+			exit(1);
 		}
+		j.output = strdup(output);
+		job = realloc(job, sizeof(*job) * (n + 1));
+		job[n++] = j;
 	}
+	fclose(f);
+	*njobs = n;
+	return job;
 }
 
-int main(int argc, char *argv[])
+/* Render job and write it out, or if it fails, say why and count it in b->failed */
+static void run_batch_job(struct batch *b, struct batch_job *job, struct render_worker *w)
 {
-	unsigned char *img, *img2, *img3, *img4, *img5 = NULL;
-	struct osn_context *ctx;
-	struct grid *g, *g2, *g3, *g4, *g5;
+	struct pseudo_erosion_params p = params;
+	char whynot[100];
+	int rc;
+
+	p.seed = job->seed;
+	p.size = job->size;
+	p.grid_size = job->grid_size;
+	p.feature_size = job->feature_size;
+	rc = render(w, &p);
+	if (rc) {
+		render_failed_why(rc, &p, whynot, sizeof(whynot));
+		fprintf(stderr, "pseudo_erosion: %d x %d '%s' failed: %s\n", job->size, job->size,
+			job->output, whynot);
+		atomic_fetch_add(&b->failed, 1);
+		return;
+	}
+	if (write_heightfield(job->output, w->out, p.size, p.size)) {
+		fprintf(stderr, "pseudo_erosion: %d x %d '%s' failed: it couldn't be written\n",
+			job->size, job->size, job->output);
+		atomic_fetch_add(&b->failed, 1);
+		return;
+	}
+	printf("pseudo-erosion: %d x %d '%s' done\n", job->size, job->size, job->output);
+	fflush(stdout);
+}
 
+static void run_small_batch_job(void *arg, int i, int worker)
+{
+	struct batch *b = arg;
+
+	run_batch_job(b, &b->job[b->small[i]], &b->worker[worker]);
+}
+
+/* Returns how many jobs failed */
+static int run_batch(const char *filename)
+{
+	struct batch b;
+	struct timespec start, end;
+	int i, nsmall = 0, nworkers = thread_pool_nthreads(pool);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	b.job = read_batch_jobs(filename, &b.njobs);
+	b.small = malloc(sizeof(*b.small) * (b.njobs + 1));
+	b.worker = create_render_workers(nworkers, NULL);
+	b.big = create_render_workers(1, pool);
+	atomic_init(&b.failed, 0);
+	for (i = 0; i < b.njobs; i++)
+		if ((int64_t) b.job[i].size * b.job[i].size <= BATCH_SMALL_JOB_PIXELS)
+			b.small[nsmall++] = i;
+	printf("pseudo-erosion: %d jobs from '%s', %d small\n", b.njobs, filename, nsmall);
+	thread_pool_run(pool, nsmall, run_small_batch_job, &b);
+	for (i = 0; i < b.njobs; i++)
+		if ((int64_t) b.job[i].size * b.job[i].size > BATCH_SMALL_JOB_PIXELS)
+			run_batch_job(&b, &b.job[i], b.big);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("pseudo-erosion: %d jobs in %.3f seconds, %d failed\n", b.njobs,
+		(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9, atomic_load(&b.failed));
+
+	free_render_workers(b.worker, nworkers);
+	free_render_workers(b.big, 1);
+	for (i = 0; i < b.njobs; i++)
+		free(b.job[i].output);
+	free(b.job);
+	free(b.small);
+	return atomic_load(&b.failed);
+}
+
+/* Why a job failed, for the server's reply.  NULL if it was cancelled,
+ * the server knows why.
+ */
+static const char *render_whynot(int rc)
+{
+	switch (rc) {
+	case PSEUDO_EROSION_CANCELLED:
+		return NULL;
+	case PSEUDO_EROSION_BAD_PARAMS:
+		return "bad-params";
+	case PSEUDO_EROSION_CACHE_ERROR:
+		return "cache-error";
+	default:
+		return "error";
+	}
+}
+
+/* Server mode, see serve.h.  Each server thread renders its jobs single
+ * threaded with its own render_worker.
+ */
+static int serve_render(void *arg, int worker, const struct serve_request *req,
+			int (*cancelled)(void *cancel_arg), void *cancel_arg, float *heights,
+			const char **why)
+{
+	struct render_worker *w = &((struct render_worker *) arg)[worker];
+	struct pseudo_erosion_params p = params;
+	size_t k, npixels = (size_t) req->size * req->size;
+	int rc;
+
+	p.seed = req->seed;
+	p.size = req->size;
+	p.grid_size = req->grid_size;
+	p.feature_size = req->feature_size;
+	p.cancelled = cancelled;
+	p.cancel_arg = cancel_arg;
+#ifndef PSEUDO_EROSION_DOUBLE_HEIGHTS
+	if (!req->output) { /* straight into the reply */
+		rc = pseudo_erosion_generate(w->pe, &p, heights, p.size);
+		*why = render_whynot(rc);
+		return rc ? -1 : 0;
+	}
+#endif
+	rc = render(w, &p);
+	if (rc != 0) {
+		*why = render_whynot(rc);
+		return -1;
+	}
+	if (!req->output) {
+		for (k = 0; k < npixels; k++)
+			heights[k] = w->out[k];
+	} else if (write_heightfield(req->output, w->out, p.size, p.size)) {
+		*why = "write-failed";
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct pseudo_erosion *pe;
+	struct pseudo_erosion_terrain *t;
+	struct pseudo_erosion_edit *edit;
+	height_t *input = NULL, *out;
+	char whynot[100];
+	int i, rc, nedits;
+
+	pseudo_erosion_default_params(&params);
+	params.verbose = 1;
 	process_options(argc, argv);
+	params.cache_max_bytes = (long long) cache_megabytes << 20;
+	pseudo_erosion_default_pipeline(&pipeline);
+	if (pipeline_file)
+		read_pipeline(pipeline_file);
+	params.pipeline = &pipeline;
+	if (pseudo_erosion_check_params(&params, whynot, sizeof(whynot))) {
+		fprintf(stderr, "pseudo_erosion: %s\n", whynot);
+		usage();
+	}
+	if (edit_file && params.engine != PSEUDO_EROSION_PIXEL) {
+		fprintf(stderr, "pseudo_erosion: --edits needs the pixel engine\n");
+		usage();
+	}
+	if (batch_file) {
+		if (edit_file || input_image || params.error_report) {
+			fprintf(stderr, "pseudo_erosion: --batch can't be used with --edits, --input or -E\n");
+			usage();
+		}
+		params.verbose = 0;
+		pool = thread_pool_create(nthreads);
+		i = run_batch(batch_file);
+		thread_pool_destroy(pool);
+		return i ? 1 : 0;
+	}
+	if (socket_path) {
+		struct render_worker *w;
+		int n = nthreads > 0 ? nthreads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+		if (edit_file || input_image || params.error_report) {
+			fprintf(stderr, "pseudo_erosion: --serve can't be used with --edits, --input or -E\n");
+			usage();
+		}
+		params.verbose = 0;
+		w = create_render_workers(n, NULL);
+		printf("pseudo-erosion: serving on '%s' with %d threads\n", socket_path, n);
+		fflush(stdout);
+		if (serve(socket_path, n, serve_render, w) < 0)
+			exit(1);
+		free_render_workers(w, n);
+		return 0;
+	}
 
-	open_simplex_noise(seed, &ctx);
+	pool = thread_pool_create(nthreads);
+	pe = pseudo_erosion_create(pool);
 	printf("pseudo-erosion: Generating %d x %d heightmap image '%s'\n",
-		image_size, image_size, output_file);
-	g = allocate_grid(grid_size);
+		params.size, params.size, output_file);
 	/* First iteration, or input image */
 	if (input_image) {
-		int w, h, a;
-		char whynot[100];
-		img = (unsigned char *) png_utils_read_png_image(input_image, 0, 0, 0, &w, &h, &a, whynot, 100);
-		if (w < h)
-			image_size = w;
-		else
-			image_size = h;
+		input = read_heightfield(input_image, &params.size);
+		params.input = input;
+		params.input_stride = params.size;
+	}
+
+	if (!edit_file) {
+		if (write_intermediates)
+			params.iteration_done = write_iteration_images;
+		out = malloc(sizeof(*out) * params.size * params.size);
+		rc = pseudo_erosion_generate(pe, &params, out, params.size);
+		if (rc) {
+			render_failed_why(rc, &params, whynot, sizeof(whynot));
+			fprintf(stderr, "pseudo_erosion: '%s' failed: %s\n", output_file, whynot);
+			exit(1);
+		}
+		write_output(out);
+		free(out);
 	} else {
-		img = (unsigned char *) allocate_image(image_size);
-		setup_grid_points(ctx, g, image_size, feature_size);
-		pseudo_erosion((uint32_t *) img, ctx, g, image_size, feature_size);
+		edit = read_edits(edit_file, &nedits);
+		t = pseudo_erosion_terrain_generate(pe, &params, NULL, 0);
+		if (!t) {
+			fprintf(stderr, "pseudo_erosion: generating the terrain failed\n");
+			exit(1);
+		}
+		if (pseudo_erosion_terrain_update(pe, t, edit, nedits))
+			edits_failed(edit_file);
+		for (i = 0; i < pipeline.niterations && write_intermediates; i++)
+			write_iteration_images(NULL, i, pseudo_erosion_terrain_layer(t, i),
+						pseudo_erosion_terrain_combined(t, i), params.size);
+		if (params.error_report)
+			update_report(pe, t, edit, nedits);
+		write_output(pseudo_erosion_terrain_combined(t, pipeline.niterations - 1));
+		pseudo_erosion_terrain_free(t);
+		free(edit);
 	}
 
-	png_utils_write_png_image("img-a.png", (unsigned char *) img, image_size, image_size, 1, 0);
-
-	/* 2nd iteration */
-	img2 = (unsigned char *) allocate_image(image_size);
-	g2 = allocate_grid(grid_size * 2);
-	setup_grid_points(ctx, g2, image_size, feature_size / 2);
-	pseudo_erosion((uint32_t *) img2, ctx, g2, image_size, feature_size / 2);
-	combine_images_f1((uint32_t *) img, (uint32_t *) img2, image_size);
-
-	png_utils_write_png_image("img2.png", (unsigned char *) img2, image_size, image_size, 1, 0);
-	png_utils_write_png_image("img-b.png", (unsigned char *) img, image_size, image_size, 1, 0);
-
-	/* 3rd iteration */
-	img3 = (unsigned char *) allocate_image(image_size);
-	g3 = allocate_grid(grid_size * 4);
-	setup_grid_points_from_image(ctx, g3, image_size, feature_size / 4, (uint32_t *) img);
-	pseudo_erosion((uint32_t *) img3, ctx, g3, image_size, feature_size / 4);
-	combine_images_f2((uint32_t *) img, (uint32_t *) img3, image_size);
-
-	png_utils_write_png_image("img3.png", (unsigned char *) img3, image_size, image_size, 1, 0);
-	png_utils_write_png_image("img-c.png", (unsigned char *) img, image_size, image_size, 1, 0);
-
-	/* 4th iteration */
-	img4 = (unsigned char *) allocate_image(image_size);
-	g4 = allocate_grid(grid_size * 8);
-	setup_grid_points_from_image(ctx, g4, image_size, feature_size / 8, (uint32_t *) img);
-	pseudo_erosion((uint32_t *) img4, ctx, g4, image_size, feature_size / 8);
-	combine_images_f3((uint32_t *) img, (uint32_t *) img3, (uint32_t *) img4, image_size);
-
-	png_utils_write_png_image("img4.png", (unsigned char *) img4, image_size, image_size, 1, 0);
-	png_utils_write_png_image("img-d.png", (unsigned char *) img, image_size, image_size, 1, 0);
-
-	/* 5th iteration */
-	img5 = (unsigned char *) allocate_image(image_size);
-	g5 = allocate_grid(grid_size * 16);
-	setup_grid_points_from_image(ctx, g5, image_size, feature_size / 16, (uint32_t *) img);
-	pseudo_erosion((uint32_t *) img5, ctx, g5, image_size, feature_size / 16);
-	combine_images_f4((uint32_t *) img, (uint32_t *) img3, (uint32_t *) img4, (uint32_t *) img5, image_size);
-
-	png_utils_write_png_image("img5.png", (unsigned char *) img5, image_size, image_size, 1, 0);
-	png_utils_write_png_image("img-e.png", (unsigned char *) img, image_size, image_size, 1, 0);
-
-	png_utils_write_png_image(output_file, (unsigned char *) img, image_size, image_size, 1, 0);
-	open_simplex_noise_free(ctx);
-	free_grid(g);
+	pseudo_erosion_destroy(pe);
+	free(input);
+	thread_pool_destroy(pool);
 	return 0;
 }
@@ -0,0 +1,720 @@
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "serve.h"
+
+#define SERVE_MAX_CLIENTS 64
+#define SERVE_LINE_MAX 1200
+#define SERVE_MAX_SIZE 16384
+#define LATENCY_SAMPLES 1024 /* the percentiles are over this many most recent jobs */
+
+struct client {
+	int fd;
+	int refs; /* the connection, plus one per job not yet answered, under the server lock */
+	int wake; /* written to to get the poll thread to look at out */
+	pthread_mutex_t out_lock; /* guards out, out_start, out_end, out_size and gone */
+	char *out; /* replies not yet sent, from out + out_start to out + out_end */
+	size_t out_start, out_end, out_size;
+	int gone; /* dropped, or cut off for not reading, no more replies */
+	char line[SERVE_LINE_MAX];
+	int len;
+};
+
+struct job {
+	struct client *client;
+	int id, priority;
+	unsigned long seq;
+	double arrival, deadline; /* seconds, deadline 0 for none */
+	atomic_int cancel;
+	struct serve_request req;
+	char *output;
+	struct job *next;
+};
+
+struct server {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	struct job *queue, *running;
+	int nqueued, nrunning;
+	unsigned long seq;
+	int shutdown;
+	serve_render_fn render;
+	void *arg;
+	float **heights; /* each worker's buffer for raw replies */
+	size_t *heights_size;
+	int wake[2]; /* pipe waking the poll thread when there are replies to send */
+	double latency[LATENCY_SAMPLES];
+	long ndone, nfailed;
+};
+
+struct worker_arg {
+	struct server *s;
+	int id;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Stop sending to c and let go of what it hasn't read, called with c->out_lock held */
+static void cut_off(struct client *c)
+{
+	c->gone = 1;
+	free(c->out);
+	c->out = NULL;
+	c->out_start = c->out_end = c->out_size = 0;
+}
+
+/* Room for n more bytes at the end of c's output, called with c->out_lock
+ * held.  Returns NULL if c is gone, or if it already has replies waiting
+ * and these would take it past SERVE_MAX_OUTPUT, in which case it is cut
+ * off.  A reply to a client that has read everything always fits, however
+ * big it is.
+ */
+static char *out_reserve(struct client *c, size_t n)
+{
+	size_t pending = c->out_end - c->out_start, size;
+	char *out;
+
+	if (c->gone)
+		return NULL;
+	if (pending > 0 && pending + n > SERVE_MAX_OUTPUT) {
+		cut_off(c);
+		return NULL;
+	}
+	if (c->out_end + n > c->out_size) {
+		memmove(c->out, c->out + c->out_start, pending);
+		c->out_start = 0;
+		c->out_end = pending;
+	}
+	if (pending + n > c->out_size) {
+		size = c->out_size * 2 < SERVE_MAX_OUTPUT ? c->out_size * 2 : SERVE_MAX_OUTPUT;
+		if (size < pending + n)
+			size = pending + n;
+		out = realloc(c->out, size);
+		if (!out) {
+			cut_off(c);
+			return NULL;
+		}
+		c->out = out;
+		c->out_size = size;
+	}
+	c->out_end += n;
+	return c->out + c->out_end - n;
+}
+
+/* Have the poll thread send what has been put in c's output */
+static void wake_poller(struct client *c)
+{
+	ssize_t rc;
+
+	do {
+		rc = write(c->wake, "", 1);
+	} while (rc < 0 && errno == EINTR);
+	/* a full pipe has already woken it */
+}
+
+static void reply(struct client *c, const char *fmt, int id, const char *what)
+{
+	char msg[SERVE_LINE_MAX + 100], *p;
+	int n;
+
+	n = snprintf(msg, sizeof(msg), fmt, id, what);
+	if (n >= (int) sizeof(msg))
+		n = sizeof(msg) - 1;
+	pthread_mutex_lock(&c->out_lock);
+	p = out_reserve(c, n);
+	if (p)
+		memcpy(p, msg, n);
+	pthread_mutex_unlock(&c->out_lock);
+	wake_poller(c);
+}
+
+/* Send as much of c's output as the socket takes without blocking.
+ * Returns -1 if the client has gone or been cut off.
+ */
+static int flush_output(struct client *c)
+{
+	ssize_t rc;
+	int ret = 0;
+
+	pthread_mutex_lock(&c->out_lock);
+	while (!c->gone && c->out_start < c->out_end) {
+		rc = send(c->fd, c->out + c->out_start, c->out_end - c->out_start,
+				MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (rc <= 0) {
+			cut_off(c);
+			break;
+		}
+		c->out_start += rc;
+	}
+	if (c->out_start == c->out_end)
+		c->out_start = c->out_end = 0;
+	if (c->gone)
+		ret = -1;
+	pthread_mutex_unlock(&c->out_lock);
+	return ret;
+}
+
+/* Called with the server lock held */
+static void client_put(struct client *c)
+{
+	if (--c->refs > 0)
+		return;
+	close(c->fd);
+	pthread_mutex_destroy(&c->out_lock);
+	free(c->out);
+	free(c);
+}
+
+static void free_job(struct job *j)
+{
+	free(j->output);
+	free(j);
+}
+
+/* Unlink j from list, called with the server lock held */
+static void unlink_job(struct job **list, struct job *j)
+{
+	struct job **p;
+
+	for (p = list; *p; p = &(*p)->next) {
+		if (*p == j) {
+			*p = j->next;
+			return;
+		}
+	}
+}
+
+/* The highest priority queued job, the earliest one among equals */
+static struct job *take_job(struct server *s)
+{
+	struct job *j, *best = NULL;
+
+	for (j = s->queue; j; j = j->next)
+		if (!best || j->priority > best->priority ||
+			(j->priority == best->priority && j->seq < best->seq))
+			best = j;
+	unlink_job(&s->queue, best);
+	s->nqueued--;
+	best->next = s->running;
+	s->running = best;
+	s->nrunning++;
+	return best;
+}
+
+static int past_deadline(const struct job *j, double t)
+{
+	return j->deadline > 0.0 && t > j->deadline;
+}
+
+static int job_cancelled(void *arg)
+{
+	struct job *j = arg;
+
+	return atomic_load(&j->cancel) || past_deadline(j, now());
+}
+
+/* Unlink the queued jobs past their deadline, called with the server lock
+ * held.  Returns them for answer_dropped() once the lock is released.
+ */
+static struct job *expire_jobs(struct server *s)
+{
+	struct job *j, *next, *dropped = NULL;
+	double t = now();
+
+	for (j = s->queue; j; j = next) {
+		next = j->next;
+		if (!past_deadline(j, t))
+			continue;
+		unlink_job(&s->queue, j);
+		s->nqueued--;
+		s->nfailed++;
+		j->next = dropped;
+		dropped = j;
+	}
+	return dropped;
+}
+
+/* Answer "failed id why" (unless why is NULL) for, and free, jobs taken off the queue */
+static void answer_dropped(struct server *s, struct job *dropped, const char *why)
+{
+	struct job *j, *next;
+
+	for (j = dropped; j; j = next) {
+		next = j->next;
+		if (why)
+			reply(j->client, "failed %d %s\n", j->id, why);
+		pthread_mutex_lock(&s->lock);
+		client_put(j->client);
+		pthread_mutex_unlock(&s->lock);
+		free_job(j);
+	}
+}
+
+static void run_job(struct server *s, int worker, struct job *j)
+{
+	size_t nbytes = (size_t) j->req.size * j->req.size * sizeof(float);
+	char header[100], *p;
+	const char *why = NULL;
+	float *h = NULL;
+	int n, rc = -1;
+
+	if (!job_cancelled(j)) {
+		if (!j->req.output) {
+			if (s->heights_size[worker] < nbytes) {
+				free(s->heights[worker]);
+				s->heights[worker] = malloc(nbytes);
+				s->heights_size[worker] = nbytes;
+			}
+			h = s->heights[worker];
+		}
+		rc = s->render(s->arg, worker, &j->req, job_cancelled, j, h, &why);
+	}
+	if (rc != 0) {
+		if (!why) /* it stopped because job_cancelled() said to */
+			why = atomic_load(&j->cancel) ? "cancelled" : "deadline";
+		reply(j->client, "failed %d %s\n", j->id, why);
+	} else if (j->req.output) {
+		reply(j->client, "done %d file %s\n", j->id, j->req.output);
+	} else {
+		n = snprintf(header, sizeof(header), "done %d raw %zu\n", j->id, nbytes);
+		pthread_mutex_lock(&j->client->out_lock);
+		p = out_reserve(j->client, n + nbytes);
+		if (p) {
+			memcpy(p, header, n);
+			memcpy(p + n, h, nbytes);
+		}
+		pthread_mutex_unlock(&j->client->out_lock);
+		wake_poller(j->client);
+	}
+
+	pthread_mutex_lock(&s->lock);
+	unlink_job(&s->running, j);
+	s->nrunning--;
+	if (rc == 0)
+		s->latency[s->ndone++ % LATENCY_SAMPLES] = now() - j->arrival;
+	else
+		s->nfailed++;
+	client_put(j->client);
+	pthread_mutex_unlock(&s->lock);
+	free_job(j);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker_arg *wa = arg;
+	struct server *s = wa->s;
+	struct job *j, *expired;
+
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		while (!s->shutdown && !s->queue)
+			pthread_cond_wait(&s->work, &s->lock);
+		if (s->shutdown) {
+			pthread_mutex_unlock(&s->lock);
+			return NULL;
+		}
+		expired = expire_jobs(s);
+		j = s->queue ? take_job(s) : NULL;
+		pthread_mutex_unlock(&s->lock);
+		answer_dropped(s, expired, "deadline");
+		if (j)
+			run_job(s, wa->id, j);
+	}
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void send_stats(struct server *s, struct client *c)
+{
+	double lat[LATENCY_SAMPLES], p50 = 0.0, p99 = 0.0;
+	struct job *expired;
+	char msg[200], *p;
+	int n, nqueued, nrunning;
+	long ndone, nfailed;
+
+	pthread_mutex_lock(&s->lock);
+	expired = expire_jobs(s);
+	n = s->ndone < LATENCY_SAMPLES ? s->ndone : LATENCY_SAMPLES;
+	memcpy(lat, s->latency, sizeof(*lat) * n);
+	nqueued = s->nqueued;
+	nrunning = s->nrunning;
+	ndone = s->ndone;
+	nfailed = s->nfailed;
+	pthread_mutex_unlock(&s->lock);
+	answer_dropped(s, expired, "deadline");
+
+	if (n > 0) { /* nearest rank */
+		qsort(lat, n, sizeof(*lat), compare_doubles);
+		p50 = lat[(int) ceil(0.50 * n) - 1];
+		p99 = lat[(int) ceil(0.99 * n) - 1];
+	}
+	n = snprintf(msg, sizeof(msg), "stats queued=%d running=%d done=%ld failed=%ld p50_ms=%.3f p99_ms=%.3f\n",
+		nqueued, nrunning, ndone, nfailed, p50 * 1000.0, p99 * 1000.0);
+	pthread_mutex_lock(&c->out_lock);
+	p = out_reserve(c, n);
+	if (p)
+		memcpy(p, msg, n);
+	pthread_mutex_unlock(&c->out_lock);
+}
+
+static void queue_job(struct server *s, struct client *c, char *line)
+{
+	struct job *j, *expired;
+	char *opt, *save;
+	int n, ms;
+
+	j = calloc(1, sizeof(*j));
+	if (sscanf(line, "job %d %d %d %d %d%n", &j->id, &j->req.seed, &j->req.size,
+			&j->req.grid_size, &j->req.feature_size, &n) != 5) {
+		free(j);
+		reply(c, "failed %d %s\n", -1, "bad job");
+		return;
+	}
+	j->arrival = now();
+	for (opt = strtok_r(line + n, " \t", &save); opt; opt = strtok_r(NULL, " \t", &save)) {
+		if (sscanf(opt, "priority=%d", &j->priority) == 1)
+			continue;
+		if (sscanf(opt, "deadline=%d", &ms) == 1 && ms > 0) {
+			j->deadline = j->arrival + ms * 1e-3;
+			continue;
+		}
+		if (strncmp(opt, "output=", 7) == 0 && opt[7]) {
+			free(j->output);
+			j->output = strdup(opt + 7);
+			continue;
+		}
+		j->req.size = 0; /* anything else is a bad job */
+	}
+	if (j->id < 0 || j->req.size < 1 || j->req.size > SERVE_MAX_SIZE ||
+		j->req.grid_size < 1 || j->req.feature_size < 1) {
+		reply(c, "failed %d %s\n", j->id, "bad job");
+		free_job(j);
+		return;
+	}
+	j->req.output = j->output;
+	j->client = c;
+	atomic_init(&j->cancel, 0);
+
+	pthread_mutex_lock(&s->lock);
+	expired = expire_jobs(s);
+	if (s->nqueued >= SERVE_MAX_QUEUED) {
+		pthread_mutex_unlock(&s->lock);
+		answer_dropped(s, expired, "deadline");
+		reply(c, "failed %d %s\n", j->id, "queue full");
+		free_job(j);
+		return;
+	}
+	c->refs++;
+	j->seq = s->seq++;
+	j->next = s->queue;
+	s->queue = j;
+	s->nqueued++;
+	pthread_cond_signal(&s->work);
+	pthread_mutex_unlock(&s->lock);
+	answer_dropped(s, expired, "deadline");
+}
+
+static int job_matches(struct job *j, struct client *c, int id)
+{
+	return (!c || j->client == c) && (id < 0 || j->id == id);
+}
+
+/* Cancel c's job id, every job of c's if id is -1, or every job there is
+ * if c is NULL too.  Queued ones are answered (if answer is set) and freed
+ * here, running ones are flagged and their workers answer them.  Returns
+ * the number of jobs found.
+ */
+static int cancel_jobs(struct server *s, struct client *c, int id, int answer)
+{
+	struct job *j, *next, *dropped = NULL;
+	int found = 0;
+
+	pthread_mutex_lock(&s->lock);
+	for (j = s->queue; j; j = next) {
+		next = j->next;
+		if (!job_matches(j, c, id))
+			continue;
+		unlink_job(&s->queue, j);
+		s->nqueued--;
+		s->nfailed++;
+		j->next = dropped;
+		dropped = j;
+		found++;
+	}
+	for (j = s->running; j; j = j->next) {
+		if (!job_matches(j, c, id))
+			continue;
+		atomic_store(&j->cancel, 1);
+		found++;
+	}
+	pthread_mutex_unlock(&s->lock);
+	answer_dropped(s, dropped, answer ? "cancelled" : NULL);
+	return found;
+}
+
+/* Returns 1 on shutdown */
+static int handle_line(struct server *s, struct client *c, char *line)
+{
+	int id;
+
+	if (strncmp(line, "job ", 4) == 0) {
+		queue_job(s, c, line);
+	} else if (sscanf(line, "cancel %d", &id) == 1 && id >= 0) {
+		if (!cancel_jobs(s, c, id, 1))
+			reply(c, "failed %d %s\n", id, "unknown job");
+	} else if (strcmp(line, "stats") == 0) {
+		send_stats(s, c);
+	} else if (strcmp(line, "shutdown") == 0) {
+		return 1;
+	} else if (line[0]) {
+		reply(c, "failed %d %s\n", -1, "unknown command");
+	}
+	return 0;
+}
+
+/* Read what c has sent and act on every whole line.  Returns -1 when the
+ * client has gone, 1 on shutdown.
+ */
+static int handle_input(struct server *s, struct client *c)
+{
+	ssize_t n;
+	char *nl, *start;
+
+	n = recv(c->fd, c->line + c->len, sizeof(c->line) - 1 - c->len, 0);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (n <= 0)
+		return -1;
+	c->len += n;
+	c->line[c->len] = '\0';
+	start = c->line;
+	while ((nl = strchr(start, '\n'))) {
+		*nl = '\0';
+		if (nl > start && nl[-1] == '\r')
+			nl[-1] = '\0';
+		if (handle_line(s, c, start))
+			return 1;
+		start = nl + 1;
+	}
+	c->len -= start - c->line;
+	memmove(c->line, start, c->len);
+	if (c->len == sizeof(c->line) - 1) {
+		reply(c, "failed %d %s\n", -1, "line too long");
+		c->len = 0;
+	}
+	return 0;
+}
+
+static void set_nonblocking(int fd)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* Whether c has been cut off, and else the events to poll it for */
+static int client_events(struct client *c, short *events)
+{
+	int gone;
+
+	pthread_mutex_lock(&c->out_lock);
+	gone = c->gone;
+	*events = POLLIN;
+	if (c->out_start < c->out_end)
+		*events |= POLLOUT;
+	pthread_mutex_unlock(&c->out_lock);
+	return gone;
+}
+
+static void drop_client(struct server *s, struct client *c)
+{
+	pthread_mutex_lock(&c->out_lock);
+	cut_off(c);
+	pthread_mutex_unlock(&c->out_lock);
+	cancel_jobs(s, c, -1, 0);
+	pthread_mutex_lock(&s->lock);
+	client_put(c);
+	pthread_mutex_unlock(&s->lock);
+}
+
+int serve(const char *socket_path, int nworkers, serve_render_fn render, void *arg)
+{
+	struct server s;
+	struct sockaddr_un addr;
+	struct client *client[SERVE_MAX_CLIENTS];
+	struct pollfd pfd[SERVE_MAX_CLIENTS + 2];
+	struct worker_arg *wa;
+	pthread_t *thread;
+	char drain[64];
+	int i, fd, rc, listener, nclients = 0, done = 0;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "serve: socket path '%s' is too long\n", socket_path);
+		return -1;
+	}
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0) {
+		fprintf(stderr, "serve: socket: %s\n", strerror(errno));
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	unlink(socket_path);
+	if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listener, 16) < 0) {
+		fprintf(stderr, "serve: %s: %s\n", socket_path, strerror(errno));
+		close(listener);
+		return -1;
+	}
+
+	memset(&s, 0, sizeof(s));
+	if (pipe(s.wake) < 0) {
+		fprintf(stderr, "serve: pipe: %s\n", strerror(errno));
+		close(listener);
+		unlink(socket_path);
+		return -1;
+	}
+	set_nonblocking(s.wake[0]);
+	set_nonblocking(s.wake[1]);
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.work, NULL);
+	s.render = render;
+	s.arg = arg;
+	s.heights = calloc(nworkers, sizeof(*s.heights));
+	s.heights_size = calloc(nworkers, sizeof(*s.heights_size));
+	wa = malloc(sizeof(*wa) * nworkers);
+	thread = malloc(sizeof(*thread) * nworkers);
+	for (i = 0; i < nworkers; i++) {
+		wa[i].s = &s;
+		wa[i].id = i;
+		pthread_create(&thread[i], NULL, worker_thread, &wa[i]);
+	}
+
+	while (!done) {
+		for (i = nclients - 1; i >= 0; i--) {
+			if (!client_events(client[i], &pfd[i + 2].events))
+				continue;
+			drop_client(&s, client[i]);
+			client[i] = client[--nclients];
+		}
+		pfd[0].fd = listener;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = s.wake[0];
+		pfd[1].events = POLLIN;
+		for (i = 0; i < nclients; i++) {
+			pfd[i + 2].fd = client[i]->fd;
+			client_events(client[i], &pfd[i + 2].events);
+		}
+		if (poll(pfd, nclients + 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "serve: poll: %s\n", strerror(errno));
+			break;
+		}
+		if (pfd[1].revents)
+			while (read(s.wake[0], drain, sizeof(drain)) > 0)
+				;
+		for (i = nclients - 1; i >= 0 && !done; i--) {
+			rc = 0;
+			if (pfd[i + 2].revents & POLLOUT)
+				rc = flush_output(client[i]);
+			if (rc == 0 && (pfd[i + 2].revents & ~POLLOUT))
+				rc = handle_input(&s, client[i]);
+			switch (rc) {
+			case 1:
+				done = 1;
+				break;
+			case -1:
+				drop_client(&s, client[i]);
+				client[i] = client[--nclients];
+				break;
+			}
+		}
+		if (done || !(pfd[0].revents & POLLIN))
+			continue;
+		fd = accept(listener, NULL, NULL);
+		if (fd < 0)
+			continue;
+		if (nclients == SERVE_MAX_CLIENTS) {
+			close(fd);
+			continue;
+		}
+		set_nonblocking(fd);
+		client[nclients] = calloc(1, sizeof(**client));
+		client[nclients]->fd = fd;
+		client[nclients]->refs = 1;
+		client[nclients]->wake = s.wake[1];
+		pthread_mutex_init(&client[nclients]->out_lock, NULL);
+		nclients++;
+	}
+
+	cancel_jobs(&s, NULL, -1, 1);
+	pthread_mutex_lock(&s.lock);
+	s.shutdown = 1;
+	pthread_cond_broadcast(&s.work);
+	pthread_mutex_unlock(&s.lock);
+	for (i = 0; i < nworkers; i++)
+		pthread_join(thread[i], NULL);
+	for (i = 0; i < nclients; i++) {
+		flush_output(client[i]); /* whatever goes without waiting */
+		client_put(client[i]);
+	}
+	for (i = 0; i < nworkers; i++)
+		free(s.heights[i]);
+	free(s.heights);
+	free(s.heights_size);
+	free(wa);
+	free(thread);
+	close(listener);
+	close(s.wake[0]);
+	close(s.wake[1]);
+	unlink(socket_path);
+	pthread_cond_destroy(&s.work);
+	pthread_mutex_destroy(&s.lock);
+	return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef SERVE_H__
+#define SERVE_H__
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * A generation daemon on a local (AF_UNIX, SOCK_STREAM) socket.  Clients
+ * send one command per line:
+ *
+ *	job id seed size gridsize featuresize [priority=n] [deadline=ms] [output=file]
+ *		Queue a heightmap.  Higher priorities go first, ties in order of
+ *		arrival.  A job that hasn't finished deadline milliseconds after
+ *		it arrived is dropped with "failed id deadline": a running one
+ *		at the end of its current iteration, a queued one as soon as the
+ *		queue is next looked at (by a worker taking a job, a new job or
+ *		stats), so that it doesn't hold a place in the queue.  The reply,
+ *		once the job is done, is either "done id file file", the png
+ *		having been written there, or, with no output file, "done id raw
+ *		nbytes" followed by nbytes of heights, size x size native endian
+ *		32 bit floats, row by row.  A job that
+ *		doesn't get done is answered "failed id reason", the reason
+ *		being cancelled, deadline, queue full, bad job, or the renderer's
+ *		own, such as bad-params or write-failed.
+ *	cancel id
+ *		Cancel the job.  A queued one is dropped, a running one stops
+ *		at the end of its current iteration, either way it is answered
+ *		"failed id cancelled".  Jobs are cancelled too when their
+ *		client disconnects.
+ *	stats
+ *		"stats queued=n running=n done=n failed=n p50_ms=t p99_ms=t", the
+ *		latencies (arrival to reply) being over the last jobs done.
+ *	shutdown
+ *		Cancel everything and exit.
+ *
+ * Ids are the client's own, any int >= 0, and only mean something on that
+ * connection.  At most SERVE_MAX_QUEUED jobs wait at once, beyond that
+ * jobs are refused with "failed id queue full".  Each of nworkers threads
+ * runs one job at a time.
+ *
+ * Replies wait in a buffer per client until its socket takes them, so a
+ * client that is slow to read holds up nobody else.  One that lets more
+ * than SERVE_MAX_OUTPUT bytes of replies pile up is disconnected, though a
+ * raw reply that is bigger than that on its own still goes to a client
+ * that had read everything before it.
+ */
+
+#define SERVE_MAX_QUEUED 64
+#define SERVE_MAX_OUTPUT (64 << 20)
+
+struct serve_request {
+	int seed, size, grid_size, feature_size;
+	const char *output; /* NULL to send the heights back instead */
+};
+
+/* Render req on worker thread worker (0 .. nworkers - 1), either writing
+ * req->output or filling heights[size * size].  Between stages it should
+ * call cancelled(cancel_arg) and give up, returning -1, if that is true.
+ * If it fails for any other reason it returns -1 and sets *why to a
+ * reason for the reply.  Otherwise it returns 0.
+ */
+typedef int (*serve_render_fn)(void *arg, int worker, const struct serve_request *req,
+				int (*cancelled)(void *cancel_arg), void *cancel_arg, float *heights,
+				const char **why);
+
+/* Listen on socket_path and serve until a shutdown command, returns 0, or -1 if
+ * the socket could not be set up.
+ */
+int serve(const char *socket_path, int nworkers, serve_render_fn render, void *arg);
+
+#endif
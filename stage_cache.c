@@ -0,0 +1,230 @@
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "stage_cache.h"
+
+#define STAGE_MAGIC "PESTAGE1"
+#define STAGE_SUFFIX ".stage"
+
+struct stage_header {
+	char magic[8];
+	uint32_t height_size; /* sizeof(pseudo_erosion_height) */
+	uint32_t dim;
+	uint64_t key;
+};
+
+struct stage_cache {
+	char *dir;
+	long long max_bytes;
+	int stored; /* anything since it was opened, so it may need evicting */
+};
+
+struct stage_file {
+	char *name;
+	long long size;
+	struct timespec mtime;
+};
+
+uint64_t stage_hash(uint64_t h, const void *data, size_t n)
+{
+	const unsigned char *d = data;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		h ^= d[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+struct stage_cache *stage_cache_open(const char *dir, long long max_bytes)
+{
+	struct stage_cache *c;
+	struct stat st;
+
+	if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+		return NULL;
+	if (stat(dir, &st) != 0)
+		return NULL;
+	if (!S_ISDIR(st.st_mode)) {
+		errno = ENOTDIR;
+		return NULL;
+	}
+	if (access(dir, R_OK | W_OK | X_OK) != 0)
+		return NULL;
+	c = calloc(1, sizeof(*c));
+	c->dir = strdup(dir);
+	c->max_bytes = max_bytes;
+	return c;
+}
+
+static void stage_name(struct stage_cache *c, uint64_t key, char *name, size_t len)
+{
+	snprintf(name, len, "%s/%016llx" STAGE_SUFFIX, c->dir, (unsigned long long) key);
+}
+
+static void make_header(struct stage_header *hdr, uint64_t key, int dim)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, STAGE_MAGIC, sizeof(hdr->magic));
+	hdr->height_size = sizeof(pseudo_erosion_height);
+	hdr->dim = dim;
+	hdr->key = key;
+}
+
+FILE *stage_cache_find(struct stage_cache *c, uint64_t key, int dim)
+{
+	struct stage_header want, hdr;
+	struct stat st;
+	char name[PATH_MAX];
+	FILE *f;
+
+	stage_name(c, key, name, sizeof(name));
+	f = fopen(name, "r");
+	if (!f)
+		return NULL;
+	make_header(&want, key, dim);
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(&hdr, &want, sizeof(hdr)) != 0 ||
+		fstat(fileno(f), &st) != 0 ||
+		st.st_size != (off_t) (sizeof(hdr) + sizeof(pseudo_erosion_height) * dim * dim)) {
+		fclose(f);
+		return NULL;
+	}
+	futimens(fileno(f), NULL); /* just used */
+	return f;
+}
+
+int stage_cache_read(FILE *f, pseudo_erosion_height *h, int dim, int stride)
+{
+	int y;
+
+	for (y = 0; y < dim; y++)
+		if (fread(&h[(size_t) y * stride], sizeof(*h), dim, f) != (size_t) dim)
+			return -1;
+	return 0;
+}
+
+void stage_cache_store(struct stage_cache *c, uint64_t key, const pseudo_erosion_height *h,
+			int dim, int stride)
+{
+	struct stage_header hdr;
+	char name[PATH_MAX], tmp[PATH_MAX];
+	int fd, y, ok;
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s/.tmp-XXXXXX", c->dir);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+	fchmod(fd, 0644); /* mkstemp makes it 0600 */
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	make_header(&hdr, key, dim);
+	ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+	for (y = 0; ok && y < dim; y++)
+		ok = fwrite(&h[(size_t) y * stride], sizeof(*h), dim, f) == (size_t) dim;
+	ok = fclose(f) == 0 && ok;
+	stage_name(c, key, name, sizeof(name));
+	if (!ok || rename(tmp, name) != 0) {
+		unlink(tmp);
+		return;
+	}
+	c->stored = 1;
+}
+
+static int older(const void *a, const void *b)
+{
+	const struct stage_file *fa = a, *fb = b;
+
+	if (fa->mtime.tv_sec != fb->mtime.tv_sec)
+		return fa->mtime.tv_sec < fb->mtime.tv_sec ? -1 : 1;
+	if (fa->mtime.tv_nsec != fb->mtime.tv_nsec)
+		return fa->mtime.tv_nsec < fb->mtime.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/* Delete the least recently used stages until the directory fits in max_bytes */
+static void evict(struct stage_cache *c)
+{
+	struct stage_file *file = NULL;
+	struct dirent *de;
+	struct stat st;
+	char name[PATH_MAX];
+	long long total = 0;
+	size_t len;
+	int i, n = 0, nalloc = 0;
+	DIR *d;
+
+	d = opendir(c->dir);
+	if (!d)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		len = strlen(de->d_name);
+		if (len <= strlen(STAGE_SUFFIX) ||
+			strcmp(de->d_name + len - strlen(STAGE_SUFFIX), STAGE_SUFFIX) != 0)
+			continue;
+		snprintf(name, sizeof(name), "%s/%s", c->dir, de->d_name);
+		if (stat(name, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		if (n == nalloc) {
+			nalloc = nalloc ? 2 * nalloc : 64;
+			file = realloc(file, sizeof(*file) * nalloc);
+		}
+		file[n].name = strdup(name);
+		file[n].size = st.st_size;
+		file[n].mtime = st.st_mtim;
+		total += st.st_size;
+		n++;
+	}
+	closedir(d);
+	qsort(file, n, sizeof(*file), older);
+	for (i = 0; i < n && total > c->max_bytes; i++)
+		if (unlink(file[i].name) == 0 || errno == ENOENT) /* or someone else evicted it */
+			total -= file[i].size;
+	for (i = 0; i < n; i++)
+		free(file[i].name);
+	free(file);
+}
+
+void stage_cache_close(struct stage_cache *c)
+{
+	if (!c)
+		return;
+	if (c->stored && c->max_bytes > 0)
+		evict(c);
+	free(c->dir);
+	free(c);
+}
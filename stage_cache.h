@@ -0,0 +1,73 @@
+#ifndef STAGE_CACHE_H__
+#define STAGE_CACHE_H__
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * An on-disk cache of pipeline stages, so that a run that changes only, say,
+ * the last iteration's grid or combine expression can reuse every stage
+ * before it from the runs that came before.  Each stage is stored under a
+ * 64 bit key, a hash of everything that went into it, see stage_hash(), as
+ * the file <key in hex>.stage in the cache directory: a small header and
+ * then the heights, row by row.  Files are written under a temporary name
+ * and renamed into place, so a stage is never seen half written, and any
+ * number of processes or threads can share a directory.  A file's
+ * modification time is when it was last used, and when a cache is closed
+ * after storing anything, the least recently used stages are deleted until
+ * the whole directory fits in its size limit.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "libpseudoerosion.h"
+
+#define STAGE_HASH_INIT 14695981039346656037ULL
+
+/* Add n bytes of data to hash h (FNV-1a), start with STAGE_HASH_INIT */
+uint64_t stage_hash(uint64_t h, const void *data, size_t n);
+
+struct stage_cache;
+
+/* Open the cache in dir, creating the directory if need be.  max_bytes is
+ * the size limit, 0 for none.  NULL, with errno set, if dir can't be used.
+ */
+struct stage_cache *stage_cache_open(const char *dir, long long max_bytes);
+void stage_cache_close(struct stage_cache *c);
+
+/* The stored dim x dim stage for key, open and ready for stage_cache_read(),
+ * or NULL if there isn't one.  Once found, it stays readable even if it is
+ * evicted before it is read.
+ */
+FILE *stage_cache_find(struct stage_cache *c, uint64_t key, int dim);
+
+/* Read a stage found by stage_cache_find() into h, rows stride apart.
+ * 0, or -1 if it couldn't be read.
+ */
+int stage_cache_read(FILE *f, pseudo_erosion_height *h, int dim, int stride);
+
+/* Store the dim x dim stage h, rows stride apart, under key.  Failing to is
+ * not an error, the stage just won't be found next time.
+ */
+void stage_cache_store(struct stage_cache *c, uint64_t key, const pseudo_erosion_height *h,
+			int dim, int stride);
+
+#endif
@@ -0,0 +1,182 @@
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "thread_pool.h"
+#include "task_graph.h"
+
+struct task {
+	task_graph_fn fn;
+	void *arg;
+	int flags;
+	int waiting_on; /* tasks it depends on that aren't done yet */
+	int started;
+	int *dependent; /* the tasks depending on this one */
+	int ndependents;
+};
+
+struct task_graph {
+	struct task *task;
+	int ntasks, nallocated;
+	int ndone;
+	int side_busy; /* the serial lane is running a task */
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+};
+
+struct task_graph *task_graph_create(void)
+{
+	struct task_graph *g;
+
+	g = malloc(sizeof(*g));
+	memset(g, 0, sizeof(*g));
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_cond_init(&g->changed, NULL);
+	return g;
+}
+
+void task_graph_destroy(struct task_graph *g)
+{
+	int i;
+
+	for (i = 0; i < g->ntasks; i++)
+		free(g->task[i].dependent);
+	free(g->task);
+	pthread_cond_destroy(&g->changed);
+	pthread_mutex_destroy(&g->lock);
+	free(g);
+}
+
+int task_graph_add(struct task_graph *g, task_graph_fn fn, void *arg, int flags)
+{
+	struct task *t;
+
+	if (g->ntasks == g->nallocated) {
+		g->nallocated = g->nallocated ? 2 * g->nallocated : 16;
+		g->task = realloc(g->task, sizeof(*g->task) * g->nallocated);
+	}
+	t = &g->task[g->ntasks];
+	memset(t, 0, sizeof(*t));
+	t->fn = fn;
+	t->arg = arg;
+	t->flags = flags;
+	return g->ntasks++;
+}
+
+void task_graph_depends(struct task_graph *g, int task, int on)
+{
+	struct task *t;
+
+	if (on < 0)
+		return;
+	if (on >= task) {
+		fprintf(stderr, "task_graph: task %d can't depend on later task %d\n", task, on);
+		abort();
+	}
+	t = &g->task[on];
+	t->dependent = realloc(t->dependent, sizeof(*t->dependent) * (t->ndependents + 1));
+	t->dependent[t->ndependents++] = task;
+	g->task[task].waiting_on++;
+}
+
+/* The first ready task the calling lane should take, or -1.  Called with the lock held. */
+static int next_task(struct task_graph *g, int side_lane)
+{
+	int i, serial = -1;
+
+	for (i = 0; i < g->ntasks; i++) {
+		if (g->task[i].started || g->task[i].waiting_on)
+			continue;
+		if (!(g->task[i].flags & TASK_GRAPH_USES_POOL)) {
+			if (serial < 0)
+				serial = i;
+			if (side_lane)
+				return i;
+		} else if (!side_lane) {
+			return i;
+		}
+	}
+	/* the pool lane only takes serial tasks the serial lane can't get to */
+	if (!side_lane && !g->side_busy)
+		return -1;
+	return serial;
+}
+
+/* Run tasks on one lane until there are none left */
+static void run_lane(struct task_graph *g, int side_lane)
+{
+	struct task *t;
+	int i, k;
+
+	pthread_mutex_lock(&g->lock);
+	while (g->ndone < g->ntasks) {
+		k = next_task(g, side_lane);
+		if (k < 0) {
+			pthread_cond_wait(&g->changed, &g->lock);
+			continue;
+		}
+		t = &g->task[k];
+		t->started = 1;
+		if (side_lane) {
+			/* so the pool lane may take the next serial task, if it is idle */
+			g->side_busy = 1;
+			pthread_cond_broadcast(&g->changed);
+		}
+		pthread_mutex_unlock(&g->lock);
+
+		t->fn(t->arg);
+
+		pthread_mutex_lock(&g->lock);
+		if (side_lane)
+			g->side_busy = 0;
+		for (i = 0; i < t->ndependents; i++)
+			g->task[t->dependent[i]].waiting_on--;
+		g->ndone++;
+		pthread_cond_broadcast(&g->changed);
+	}
+	pthread_mutex_unlock(&g->lock);
+}
+
+static void *side_lane_thread(void *arg)
+{
+	run_lane(arg, 1);
+	return NULL;
+}
+
+void task_graph_run(struct task_graph *g, struct thread_pool *pool)
+{
+	pthread_t side;
+	int i;
+
+	if (thread_pool_nthreads(pool) == 1 || pthread_create(&side, NULL, side_lane_thread, g)) {
+		for (i = 0; i < g->ntasks; i++)
+			g->task[i].fn(g->task[i].arg);
+		g->ndone = g->ntasks;
+		return;
+	}
+	run_lane(g, 0);
+	pthread_join(side, NULL);
+}
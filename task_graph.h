@@ -0,0 +1,59 @@
+#ifndef TASK_GRAPH_H__
+#define TASK_GRAPH_H__
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * A graph of tasks and the order they depend on each other in, run so that
+ * independent tasks overlap.  Tasks come in two kinds: those that spread
+ * their own work over a thread pool with thread_pool_run(), and serial
+ * ones that don't.  Since thread_pool_run() can only be running once at a
+ * time, the thread calling task_graph_run() runs the pool tasks, one after
+ * another, and a second thread runs the serial ones alongside, so things
+ * like setting up a grid or writing out an image happen while the pool is
+ * busy with something else.  When nothing else is ready either thread
+ * takes whatever is.
+ *
+ * With a NULL pool or a pool of one thread, there is no second thread, and
+ * the tasks simply run in the order they were added.  A task can only
+ * depend on tasks added before it, so that order always works.
+ */
+
+struct thread_pool;
+struct task_graph;
+
+typedef void (*task_graph_fn)(void *arg);
+
+#define TASK_GRAPH_USES_POOL 1 /* the task calls thread_pool_run() */
+
+struct task_graph *task_graph_create(void);
+void task_graph_destroy(struct task_graph *g);
+
+/* Add task fn(arg), returning its number */
+int task_graph_add(struct task_graph *g, task_graph_fn fn, void *arg, int flags);
+
+/* Task won't start until task on is done.  on < task, or -1 for no task at all. */
+void task_graph_depends(struct task_graph *g, int task, int on);
+
+/* Run every task, return when all are done */
+void task_graph_run(struct task_graph *g, struct thread_pool *pool);
+
+#endif
@@ -0,0 +1,245 @@
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "thread_pool.h"
+
+/* Each worker's remaining task range, packed as (end << 32) | begin so
+ * that the owner (taking from the front) and thieves (taking from the
+ * back) can both update it with a single compare and swap.  Padded out
+ * to a cache line so workers don't false-share their ranges.
+ */
+struct worker_slot {
+	_Atomic uint64_t range;
+	char pad[64 - sizeof(uint64_t)];
+};
+
+struct thread_pool {
+	int nthreads;
+	pthread_t *thread;
+	struct worker_slot *slot;
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	unsigned long generation;
+	int running; /* helper threads still working on the current generation */
+	int shutdown;
+	thread_pool_fn fn;
+	void *arg;
+};
+
+struct worker_arg {
+	struct thread_pool *pool;
+	int id;
+};
+
+static inline uint64_t pack_range(uint32_t begin, uint32_t end)
+{
+	return ((uint64_t) end << 32) | begin;
+}
+
+static int pop_task(struct worker_slot *s)
+{
+	uint64_t r = atomic_load(&s->range);
+	uint32_t begin, end;
+
+	do {
+		begin = (uint32_t) r;
+		end = (uint32_t) (r >> 32);
+		if (begin >= end)
+			return -1;
+	} while (!atomic_compare_exchange_weak(&s->range, &r, pack_range(begin + 1, end)));
+	return (int) begin;
+}
+
+/* Take the upper half of some other worker's remaining range and make it ours. */
+static int steal_tasks(struct thread_pool *pool, int me)
+{
+	int i, victim;
+	uint64_t r;
+	uint32_t begin, end, mid;
+
+	for (i = 1; i < pool->nthreads; i++) {
+		victim = (me + i) % pool->nthreads;
+		r = atomic_load(&pool->slot[victim].range);
+		do {
+			begin = (uint32_t) r;
+			end = (uint32_t) (r >> 32);
+			if (begin >= end)
+				break;
+			mid = begin + (end - begin) / 2;
+		} while (!atomic_compare_exchange_weak(&pool->slot[victim].range, &r,
+							pack_range(begin, mid)));
+		if (begin >= end)
+			continue;
+		atomic_store(&pool->slot[me].range, pack_range(mid, end));
+		return 1;
+	}
+	return 0;
+}
+
+static void do_tasks(struct thread_pool *pool, int me)
+{
+	int task;
+
+	for (;;) {
+		task = pop_task(&pool->slot[me]);
+		if (task < 0) {
+			if (!steal_tasks(pool, me))
+				return;
+			continue;
+		}
+		pool->fn(pool->arg, task, me);
+	}
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker_arg *wa = arg;
+	struct thread_pool *pool = wa->pool;
+	int id = wa->id;
+	unsigned long seen = 0;
+
+	free(wa);
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->generation == seen && !pool->shutdown)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->shutdown) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		do_tasks(pool, id);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->running == 0)
+			pthread_cond_signal(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return NULL;
+}
+
+struct thread_pool *thread_pool_create(int nthreads)
+{
+	struct thread_pool *pool;
+	struct worker_arg *wa;
+	int i;
+
+	if (nthreads <= 0) {
+		nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+		if (nthreads <= 0)
+			nthreads = 1;
+	}
+	pool = malloc(sizeof(*pool));
+	memset(pool, 0, sizeof(*pool));
+	pool->nthreads = nthreads;
+	if (posix_memalign((void **) &pool->slot, 64, sizeof(*pool->slot) * nthreads)) {
+		free(pool);
+		return NULL;
+	}
+	memset(pool->slot, 0, sizeof(*pool->slot) * nthreads);
+	pool->thread = malloc(sizeof(*pool->thread) * nthreads);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	/* Worker 0 is whoever calls thread_pool_run() */
+	for (i = 1; i < nthreads; i++) {
+		wa = malloc(sizeof(*wa));
+		wa->pool = pool;
+		wa->id = i;
+		if (pthread_create(&pool->thread[i], NULL, worker_thread, wa)) {
+			fprintf(stderr, "thread_pool: pthread_create failed, using %d threads\n", i);
+			free(wa);
+			pthread_mutex_lock(&pool->lock);
+			pool->nthreads = i;
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+	}
+	return pool;
+}
+
+void thread_pool_destroy(struct thread_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 1; i < pool->nthreads; i++)
+		pthread_join(pool->thread[i], NULL);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->thread);
+	free(pool->slot);
+	free(pool);
+}
+
+int thread_pool_nthreads(struct thread_pool *pool)
+{
+	return pool ? pool->nthreads : 1;
+}
+
+void thread_pool_run(struct thread_pool *pool, int ntasks, thread_pool_fn fn, void *arg)
+{
+	int i, n;
+
+	if (!pool || pool->nthreads == 1 || ntasks <= 1) {
+		for (i = 0; i < ntasks; i++)
+			fn(arg, i, 0);
+		return;
+	}
+
+	n = pool->nthreads;
+	for (i = 0; i < n; i++)
+		atomic_store(&pool->slot[i].range,
+			pack_range((uint32_t) ((int64_t) ntasks * i / n),
+				(uint32_t) ((int64_t) ntasks * (i + 1) / n)));
+
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->running = n - 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	do_tasks(pool, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->running > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
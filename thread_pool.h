@@ -0,0 +1,47 @@
+#ifndef THREAD_POOL_H__
+#define THREAD_POOL_H__
+/*
+	Copyright (C) 2017 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of pseudo-erosion.
+
+	pseudo-erosion is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	pseudo-erosion is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pseudo-erosion; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * A persistent pool of worker threads.  thread_pool_run() hands out task
+ * indices 0 .. ntasks - 1.  Each worker starts with a contiguous slice of
+ * the task range and, once its own slice is exhausted, steals the upper
+ * half of some other worker's remaining slice.  The calling thread takes
+ * part as worker 0, so a pool of 1 thread creates no threads at all.
+ *
+ * thread_pool_run() must not be called from inside a task.
+ */
+
+struct thread_pool;
+
+typedef void (*thread_pool_fn)(void *arg, int task, int worker);
+
+struct thread_pool *thread_pool_create(int nthreads); /* nthreads <= 0 means one per cpu */
+void thread_pool_destroy(struct thread_pool *pool);
+int thread_pool_nthreads(struct thread_pool *pool);
+
+/* Run fn(arg, task, worker) for every task in 0 .. ntasks - 1, return when all are done.
+ * A NULL pool runs every task on the calling thread.
+ */
+void thread_pool_run(struct thread_pool *pool, int ntasks, thread_pool_fn fn, void *arg);
+
+#endif